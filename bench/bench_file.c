@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2016 Pierre-Yves Ritschard <pyr@spootnik.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <bsd/string.h>
+#include "unklog.h"
+
+/*
+ * File output throughput: file_batch with fsync=none and
+ * fsync=interval, against the exec output piping into cat. Each
+ * writes BENCH_ITEMS payloads of BENCH_SIZE bytes, OUTPUT_BATCH at a
+ * time, to a scratch directory which is emptied after each run. The
+ * best of BENCH_RUNS runs is shown, its CPU time includes the cat
+ * process.
+ *
+ * usage: bench_file [dir]
+ */
+
+#define BENCH_ITEMS     1000000
+#define BENCH_SIZE      400
+#define BENCH_RUNS      3
+
+struct bench_case {
+    const char          *name;
+    struct output_impl  *impl;
+    const char          *fsync;
+};
+
+static void     bench_clean(const char *);
+static double   bench_cpu(void);
+static double   bench_run(const struct bench_case *, const char *, double *);
+
+static const struct bench_case bench_cases[] = {
+    { "file fsync=none", &file_output, "none" },
+    { "file fsync=interval", &file_output, "interval" },
+    { "exec cat", &exec_output, NULL },
+};
+#define BENCH_NCASES    (sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+static struct payload    payloads[OUTPUT_BATCH];
+static struct payload   *batch[OUTPUT_BATCH];
+
+void
+bench_clean(const char *dir)
+{
+    char             path[PATH_MAX];
+    DIR             *d;
+    struct dirent   *de;
+
+    if ((d = opendir(dir)) == NULL)
+        log_sys_fatal("bench_clean: cannot open %s", dir);
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        (void)snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        (void)unlink(path);
+    }
+    (void)closedir(d);
+}
+
+/*
+ * User and system time of this process and its reaped children, in
+ * seconds.
+ */
+double
+bench_cpu(void)
+{
+    struct rusage    self;
+    struct rusage    children;
+
+    (void)getrusage(RUSAGE_SELF, &self);
+    (void)getrusage(RUSAGE_CHILDREN, &children);
+    return self.ru_utime.tv_sec + self.ru_stime.tv_sec +
+        children.ru_utime.tv_sec + children.ru_stime.tv_sec +
+        (self.ru_utime.tv_usec + self.ru_stime.tv_usec +
+         children.ru_utime.tv_usec + children.ru_stime.tv_usec) / 1e6;
+}
+
+/*
+ * Returns millions of payloads per second.
+ */
+double
+bench_run(const struct bench_case *bc, const char *dir, double *cpu)
+{
+    struct output    out;
+    struct worker    w;
+    struct option    opts[2];
+    char             cmdline[PATH_MAX + 16];
+    uint64_t         start;
+    double           secs;
+    size_t           i;
+
+    bzero(&out, sizeof(out));
+    bzero(&w, sizeof(w));
+    bzero(opts, sizeof(opts));
+    TAILQ_INIT(&out.options);
+    out.flags = OUTPUT_RUN;
+    out.nworkers = 1;
+    out.batch = OUTPUT_BATCH;
+    out.impl = bc->impl;
+    w.out = &out;
+    if (bc->fsync != NULL) {
+        (void)strlcpy(opts[0].key, "dir", sizeof(opts[0].key));
+        (void)strlcpy(opts[0].val, dir, sizeof(opts[0].val));
+        (void)strlcpy(opts[1].key, "fsync", sizeof(opts[1].key));
+        (void)strlcpy(opts[1].val, bc->fsync, sizeof(opts[1].val));
+        TAILQ_INSERT_TAIL(&out.options, &opts[0], entry);
+        TAILQ_INSERT_TAIL(&out.options, &opts[1], entry);
+    } else {
+        (void)snprintf(cmdline, sizeof(cmdline), "cat > %s/exec.log", dir);
+        out.cmdline = cmdline;
+    }
+
+    *cpu = bench_cpu();
+    start = uv_hrtime();
+    (void)out.impl->start(&w);
+    for (i = 0; i < BENCH_ITEMS; i += OUTPUT_BATCH) {
+        if (out.impl->payload_batch(&w, batch, OUTPUT_BATCH) != 0)
+            log_fatal("bench_run: %s: write failed", bc->name);
+    }
+    (void)out.impl->stop(&w);
+    secs = (uv_hrtime() - start) / 1e9;
+    *cpu = bench_cpu() - *cpu;
+    bench_clean(dir);
+    return BENCH_ITEMS / secs / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char             dir[PATH_MAX];
+    static char      buf[BENCH_SIZE];
+    double           best;
+    double           cpu;
+    double           res;
+    double           used;
+    size_t           i;
+    int              run;
+
+    log_init(LOG_WARNING, "stderr");
+    (void)signal(SIGPIPE, SIG_IGN);
+    (void)snprintf(dir, sizeof(dir), "%s/bench_file.XXXXXX",
+                   (argc > 1) ? argv[1] : "/tmp");
+    if (mkdtemp(dir) == NULL)
+        log_sys_fatal("bench_file: cannot create %s", dir);
+
+    memset(buf, 'a', sizeof(buf));
+    for (i = 0; i < OUTPUT_BATCH; i++) {
+        payloads[i].refcnt = 1;
+        payloads[i].buf = buf;
+        payloads[i].len = sizeof(buf);
+        batch[i] = &payloads[i];
+    }
+    for (i = 0; i < BENCH_NCASES; i++) {
+        best = 0;
+        cpu = 0;
+        for (run = 0; run < BENCH_RUNS; run++) {
+            if ((res = bench_run(&bench_cases[i], dir, &used)) > best) {
+                best = res;
+                cpu = used;
+            }
+        }
+        printf("%s: %.2fM msg/s, %.0f MB/s, %.2fs cpu\n", bench_cases[i].name,
+               best, best * (BENCH_SIZE + 1), cpu);
+    }
+    (void)rmdir(dir);
+    return 0;
+}
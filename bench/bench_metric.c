@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2016 Pierre-Yves Ritschard <pyr@spootnik.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "unklog.h"
+
+/*
+ * Counter cost: metric_inc against the plain increment counters used
+ * to be and an atomic add on a shared counter, in nanoseconds per
+ * increment on a single thread. Then checks that metric_value is
+ * exact once each thread has incremented the same counter
+ * BENCH_ITEMS times, which the plain increment is not.
+ *
+ * usage: bench_metric [threads]
+ */
+
+#define BENCH_ITEMS     1000000
+#define BENCH_RUNS      3
+#define BENCH_THREADS   64
+
+static void     bench_plain(void);
+static void     bench_atomic(void);
+static void     bench_metric(void);
+static void     bench_thread(void *);
+static double   bench_time(void (*)(void));
+
+static volatile uint64_t        plain;
+static uint64_t                 shared;
+static struct metric_counter    counter;
+
+__attribute__((noinline)) void
+bench_plain(void)
+{
+    plain++;
+}
+
+__attribute__((noinline)) void
+bench_atomic(void)
+{
+    __atomic_add_fetch(&shared, 1, __ATOMIC_RELAXED);
+}
+
+__attribute__((noinline)) void
+bench_metric(void)
+{
+    metric_inc(&counter);
+}
+
+void
+bench_thread(void *arg)
+{
+    size_t   i;
+
+    (void)arg;
+    for (i = 0; i < BENCH_ITEMS; i++) {
+        bench_plain();
+        bench_metric();
+    }
+}
+
+/*
+ * Best of BENCH_RUNS, in nanoseconds per call.
+ */
+double
+bench_time(void (*fn)(void))
+{
+    uint64_t     start;
+    double       best = 0;
+    double       res;
+    size_t       i;
+    int          run;
+
+    for (run = 0; run < BENCH_RUNS; run++) {
+        start = uv_hrtime();
+        for (i = 0; i < BENCH_ITEMS; i++)
+            fn();
+        res = (double)(uv_hrtime() - start) / BENCH_ITEMS;
+        if (run == 0 || res < best)
+            best = res;
+    }
+    return best;
+}
+
+int
+main(int argc, char *argv[])
+{
+    uv_thread_t  threads[BENCH_THREADS];
+    size_t       count = 20;
+    size_t       i;
+
+    log_init(LOG_WARNING, "stderr");
+    if (argc > 1)
+        count = MAX(MIN(strtoul(argv[1], NULL, 10), BENCH_THREADS), 1);
+    metric_counter_init(&counter);
+
+    printf("plain %.2f ns, atomic %.2f ns, metric_inc %.2f ns\n",
+           bench_time(bench_plain), bench_time(bench_atomic),
+           bench_time(bench_metric));
+
+    plain = 0;
+    metric_counter_init(&counter);
+    for (i = 0; i < count; i++)
+        uv_thread_create(&threads[i], bench_thread, NULL);
+    for (i = 0; i < count; i++)
+        uv_thread_join(&threads[i]);
+    printf("threads %zu: expected %zu, plain %llu, metric_value %llu\n",
+           count, count * BENCH_ITEMS, (unsigned long long)plain,
+           (unsigned long long)metric_value(&counter));
+    return metric_value(&counter) != count * BENCH_ITEMS;
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2016 Pierre-Yves Ritschard <pyr@spootnik.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "unklog.h"
+
+/*
+ * Output queue throughput: the ring against the mutex, condition
+ * variable and list the output queues used to be, with a lock and a
+ * signal per item on both ends. Each producer pushes BENCH_ITEMS
+ * items to a single consumer, which pops them the way output_pop
+ * does.
+ *
+ * usage: bench_ring [producers...]
+ */
+
+#define BENCH_ITEMS     2000000
+#define BENCH_RUNS      3
+#define BENCH_THREADS   16
+
+struct bench_item {
+    STAILQ_ENTRY(bench_item)     entry;
+};
+
+STAILQ_HEAD(bench_list, bench_item);
+
+struct bench_queue {
+    uv_mutex_t           lock;
+    uv_cond_t            signal;
+    struct bench_list    items;
+    struct ring          ring;
+    uint32_t             stop;
+    struct bench_item   *pool;
+};
+
+static void     bench_push_list(void *);
+static void     bench_push_ring(void *);
+static size_t   bench_pop_list(struct bench_queue *, size_t);
+static size_t   bench_pop_ring(struct bench_queue *, size_t);
+static double   bench_run(int, size_t);
+
+static struct bench_queue   q;
+
+void
+bench_push_list(void *arg)
+{
+    struct bench_item   *items = arg;
+    size_t               i;
+
+    for (i = 0; i < BENCH_ITEMS; i++) {
+        uv_mutex_lock(&q.lock);
+        STAILQ_INSERT_TAIL(&q.items, &items[i], entry);
+        uv_cond_signal(&q.signal);
+        uv_mutex_unlock(&q.lock);
+    }
+}
+
+void
+bench_push_ring(void *arg)
+{
+    struct bench_item   *items = arg;
+    size_t               i;
+
+    for (i = 0; i < BENCH_ITEMS; i++)
+        (void)ring_put(&q.ring, &items[i], &q.stop);
+}
+
+size_t
+bench_pop_list(struct bench_queue *bq, size_t total)
+{
+    size_t   got;
+
+    for (got = 0; got < total; got++) {
+        uv_mutex_lock(&bq->lock);
+        while (STAILQ_EMPTY(&bq->items))
+            uv_cond_wait(&bq->signal, &bq->lock);
+        STAILQ_REMOVE_HEAD(&bq->items, entry);
+        uv_mutex_unlock(&bq->lock);
+    }
+    return got;
+}
+
+size_t
+bench_pop_ring(struct bench_queue *bq, size_t total)
+{
+    size_t   got;
+    size_t   count;
+
+    for (got = 0; got < total; got += count) {
+        for (count = 0; count < OUTPUT_BATCH; count++) {
+            if (ring_pop(&bq->ring) == NULL)
+                break;
+        }
+        if (count == 0)
+            (void)ring_wait(&bq->ring, OUTPUT_TICK);
+    }
+    return got;
+}
+
+/*
+ * Returns millions of items per second.
+ */
+double
+bench_run(int ring, size_t producers)
+{
+    uv_thread_t  threads[BENCH_THREADS];
+    uint64_t     start;
+    size_t       got;
+    size_t       i;
+
+    start = uv_hrtime();
+    for (i = 0; i < producers; i++)
+        uv_thread_create(&threads[i], ring ? bench_push_ring : bench_push_list,
+                         q.pool + i * BENCH_ITEMS);
+    if (ring)
+        got = bench_pop_ring(&q, producers * BENCH_ITEMS);
+    else
+        got = bench_pop_list(&q, producers * BENCH_ITEMS);
+    for (i = 0; i < producers; i++)
+        uv_thread_join(&threads[i]);
+    return got * 1000.0 / (uv_hrtime() - start);
+}
+
+int
+main(int argc, char *argv[])
+{
+    size_t   counts[BENCH_THREADS] = { 1, 2, 4 };
+    size_t   ncounts = 3;
+    size_t   producers;
+    size_t   i;
+    double   best[2];
+    double   res;
+    int      run;
+    int      ring;
+
+    log_init(LOG_WARNING, "stderr");
+    if (argc > 1) {
+        for (ncounts = 0; ncounts < BENCH_THREADS && (int)ncounts < argc - 1; ncounts++)
+            counts[ncounts] = strtoul(argv[ncounts + 1], NULL, 10);
+    }
+    uv_mutex_init(&q.lock);
+    uv_cond_init(&q.signal);
+    STAILQ_INIT(&q.items);
+    ring_init(&q.ring, RING_SIZE);
+
+    for (i = 0; i < ncounts; i++) {
+        producers = MAX(MIN(counts[i], BENCH_THREADS), 1);
+        if ((q.pool = calloc(producers * BENCH_ITEMS, sizeof(*q.pool))) == NULL)
+            log_sys_fatal("bench_ring: out of memory");
+        for (ring = 0; ring < 2; ring++) {
+            best[ring] = 0;
+            for (run = 0; run < BENCH_RUNS; run++) {
+                if ((res = bench_run(ring, producers)) > best[ring])
+                    best[ring] = res;
+            }
+        }
+        printf("producers %zu: mutex %.1f M/s, ring %.1f M/s\n",
+               producers, best[0], best[1]);
+        free(q.pool);
+    }
+    return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2016 Pierre-Yves Ritschard <pyr@spootnik.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bsd/string.h>
+#include <yajl/yajl_tree.h>
+#include "unklog.h"
+
+/*
+ * Type extraction cost: building a yajl tree and looking the type up
+ * in it, as dispatch used to, against dispatch_payload with
+ * validate=full and validate=lazy. No output is configured, so
+ * dispatch_payload stops once it has the type. Each message shape is
+ * dispatched BENCH_ITEMS times.
+ */
+
+#define BENCH_ITEMS     100000
+#define BENCH_RUNS      3
+#define BENCH_FILL      8192
+
+struct bench_shape {
+    const char          *name;
+    const char          *fmt;
+    size_t               fill;
+    const char          *type;
+};
+
+static const char  *bench_tree(const char *);
+static double       bench_run(int, struct message *);
+
+static const struct bench_shape bench_shapes[] = {
+    { "small, type first",
+      "{\"type\":\"nginx\",\"host\":\"web-1\",\"@timestamp\":\"2016-05-12T10:"
+      "00:00.000Z\",\"status\":200,\"message\":\"%.*s\"}", 64, "nginx" },
+    { "1KB, type last",
+      "{\"@timestamp\":\"2016-05-12T10:00:00.000Z\",\"host\":\"web-1\","
+      "\"request\":{\"method\":\"GET\",\"path\":\"/\",\"headers\":{\"type\":"
+      "\"text/html\"}},\"message\":\"%.*s\",\"type\":\"nginx\"}", 1024,
+      "nginx" },
+    { "8KB, type first",
+      "{\"type\":\"java\",\"host\":\"app-1\",\"level\":\"ERROR\","
+      "\"message\":\"%.*s\"}", 8192, "java" },
+};
+#define BENCH_NSHAPES   (sizeof(bench_shapes) / sizeof(bench_shapes[0]))
+
+static struct unklog    uk;
+static char             type[TYPE_MAX];
+
+const char *
+bench_tree(const char *buf)
+{
+    yajl_val     node;
+    yajl_val     val;
+    char         ebuf[512];
+    const char  *path[] = {"type", NULL};
+
+    if ((node = yajl_tree_parse(buf, ebuf, sizeof(ebuf))) == NULL)
+        log_fatal("bench_tree: bad message: %s", ebuf);
+    if ((val = yajl_tree_get(node, path, yajl_t_string)) == NULL)
+        log_fatal("bench_tree: no type in message");
+    (void)strlcpy(type, YAJL_GET_STRING(val), sizeof(type));
+    yajl_tree_free(node);
+    return type;
+}
+
+/*
+ * Best of BENCH_RUNS, in nanoseconds per message. Mode is -1 for the
+ * tree, otherwise the validate setting.
+ */
+double
+bench_run(int mode, struct message *msg)
+{
+    uint64_t     start;
+    double       best = 0;
+    double       res;
+    size_t       i;
+    int          run;
+
+    uk.validate = mode;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        start = uv_hrtime();
+        for (i = 0; i < BENCH_ITEMS; i++) {
+            if (mode == -1)
+                (void)bench_tree(msg->buf);
+            else if (dispatch_payload(msg, 1, &uk) != 1)
+                log_fatal("bench_run: message not taken");
+        }
+        res = (double)(uv_hrtime() - start) / BENCH_ITEMS;
+        if (run == 0 || res < best)
+            best = res;
+    }
+    return best;
+}
+
+int
+main(void)
+{
+    struct message   msg;
+    char             fill[BENCH_FILL];
+    char            *buf;
+    size_t           len;
+    size_t           i;
+
+    log_init(LOG_WARNING, "stderr");
+    scan_init();
+    TAILQ_INIT(&uk.outputs);
+    uk.outcount = 0;
+    uk.scan = DEFAULT_SCAN;
+    metric_counter_init(&uk.count);
+    metric_counter_init(&uk.dropped);
+
+    /* Log lines are mostly text, with the odd escape. */
+    for (i = 0; i < sizeof(fill); i++)
+        fill[i] = (i % 61 == 59) ? '\\' : (i % 61 == 60) ? 't' : 'a' + i % 26;
+
+    for (i = 0; i < BENCH_NSHAPES; i++) {
+        len = strlen(bench_shapes[i].fmt) + bench_shapes[i].fill;
+        if ((buf = malloc(len + 1)) == NULL)
+            log_sys_fatal("bench_type: out of memory");
+        (void)snprintf(buf, len + 1, bench_shapes[i].fmt,
+                       (int)bench_shapes[i].fill, fill);
+        bzero(&msg, sizeof(msg));
+        msg.buf = buf;
+        msg.len = strlen(buf);
+        printf("%s (%zu bytes): tree %.0f ns, full %.0f ns, lazy %.0f ns\n",
+               bench_shapes[i].name, msg.len, bench_run(-1, &msg),
+               bench_run(VALIDATE_FULL, &msg), bench_run(VALIDATE_LAZY, &msg));
+        if (strcmp(type, bench_shapes[i].type) != 0)
+            log_fatal("bench_type: tree found type %s", type);
+        free(buf);
+    }
+    return 0;
+}
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2016 Pierre-Yves Ritschard <pyr@spootnik.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unklog.h"
+
+/*
+ * Payload allocator.
+ *
+ * Payload headers come from size-class slabs: each thread keeps its
+ * own free list per class, and frees from any thread push objects on
+ * a shared lock-free stack which the allocating thread takes over as
+ * a whole once its own list is empty. Slab memory is kept for reuse.
+ *
+ * Message buffers are carved from large aligned chunks, owned by the
+ * thread allocating from them. A chunk counts its live buffers, plus
+ * one for its owner until it is full. Since payloads are released in
+ * roughly the order they were allocated, chunks empty out as queues
+ * drain and are handed back to the system, save for a few kept for
+ * reuse. Buffers too large for a chunk are left to malloc.
+ */
+
+#define SLAB_ALIGN      16
+#define SLAB_CLASSES    16
+#define SLAB_BLOCK      (64 * 1024)
+#define ARENA_CACHE     4
+
+struct slab_object {
+    struct slab_object  *next;
+};
+
+struct arena_chunk {
+    uint64_t             live;
+    size_t               used;
+};
+
+static void    *arena_map(size_t);
+static struct arena_chunk *arena_chunk_new(void);
+static void     arena_chunk_release(struct arena_chunk *);
+static void     slab_refill(size_t);
+
+static size_t                    arena_chunk_size = ARENA_CHUNK;
+static int                       arena_hugepages;
+static uv_mutex_t                arena_lock;
+static struct arena_chunk       *arena_cache[ARENA_CACHE];
+static size_t                    arena_ncache;
+static uint64_t                  arena_resident;
+static struct metric_counter     arena_hits;
+static struct metric_counter     arena_misses;
+static __thread struct arena_chunk *arena_current;
+
+static struct slab_object       *slab_shared[SLAB_CLASSES];
+static __thread struct slab_object *slab_local[SLAB_CLASSES];
+
+/*
+ * Chunk size is rounded up to a power of two so that a buffer's
+ * chunk is found by masking its address.
+ */
+void
+arena_init(size_t chunk, int hugepages)
+{
+    if (chunk > 0) {
+        for (arena_chunk_size = SLAB_BLOCK; arena_chunk_size < chunk; arena_chunk_size <<= 1)
+            ;
+    }
+    arena_hugepages = hugepages;
+    uv_mutex_init(&arena_lock);
+    metric_counter_init(&arena_hits);
+    metric_counter_init(&arena_misses);
+}
+
+void *
+arena_map(size_t size)
+{
+    char        *base;
+    char        *p;
+    uintptr_t    aligned;
+
+    /*
+     * Map twice the size and trim both ends to get an aligned region.
+     */
+    base = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    aligned = ((uintptr_t)base + size - 1) & ~(uintptr_t)(size - 1);
+    p = (char *)aligned;
+    if (p > base)
+        (void)munmap(base, p - base);
+    if (p + size < base + 2 * size)
+        (void)munmap(p + size, base + 2 * size - (p + size));
+#ifdef MADV_HUGEPAGE
+    if (arena_hugepages)
+        (void)madvise(p, size, MADV_HUGEPAGE);
+#endif
+    __atomic_add_fetch(&arena_resident, size, __ATOMIC_RELAXED);
+    return p;
+}
+
+struct arena_chunk *
+arena_chunk_new(void)
+{
+    struct arena_chunk  *c = NULL;
+
+    uv_mutex_lock(&arena_lock);
+    if (arena_ncache > 0)
+        c = arena_cache[--arena_ncache];
+    uv_mutex_unlock(&arena_lock);
+    if (c == NULL) {
+        metric_inc(&arena_misses);
+        if ((c = arena_map(arena_chunk_size)) == NULL)
+            return NULL;
+    }
+    c->live = 1;
+    c->used = roundup(sizeof(*c), SLAB_ALIGN);
+    return c;
+}
+
+void
+arena_chunk_release(struct arena_chunk *c)
+{
+    if (__atomic_sub_fetch(&c->live, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    uv_mutex_lock(&arena_lock);
+    if (arena_ncache < ARENA_CACHE) {
+        arena_cache[arena_ncache++] = c;
+        c = NULL;
+    }
+    uv_mutex_unlock(&arena_lock);
+    if (c != NULL) {
+        (void)munmap(c, arena_chunk_size);
+        __atomic_sub_fetch(&arena_resident, arena_chunk_size, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Returns NULL when the buffer is too large for a chunk, in which
+ * case it is up to the caller to use malloc.
+ */
+void *
+arena_alloc(size_t len)
+{
+    struct arena_chunk  *c = arena_current;
+    void                *p;
+
+    len = roundup(len, SLAB_ALIGN);
+    if (len > arena_chunk_size / 8) {
+        metric_inc(&arena_misses);
+        return NULL;
+    }
+    if (c == NULL || c->used + len > arena_chunk_size) {
+        if (c != NULL)
+            arena_chunk_release(c);
+        if ((arena_current = c = arena_chunk_new()) == NULL)
+            return NULL;
+    }
+    metric_inc(&arena_hits);
+    p = (char *)c + c->used;
+    c->used += len;
+    __atomic_add_fetch(&c->live, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+void
+arena_free(void *p)
+{
+    arena_chunk_release((struct arena_chunk *)((uintptr_t)p & ~(uintptr_t)(arena_chunk_size - 1)));
+}
+
+void
+slab_refill(size_t cls)
+{
+    struct slab_object  *obj;
+    char                *block;
+    size_t               size;
+    size_t               off;
+
+    size = (cls + 1) * SLAB_ALIGN;
+    if ((block = arena_map(SLAB_BLOCK)) == NULL)
+        return;
+    for (off = 0; off + size <= SLAB_BLOCK; off += size) {
+        obj = (struct slab_object *)(block + off);
+        obj->next = slab_local[cls];
+        slab_local[cls] = obj;
+    }
+}
+
+void *
+slab_alloc(size_t size)
+{
+    struct slab_object  *obj;
+    size_t               cls;
+
+    cls = (size + SLAB_ALIGN - 1) / SLAB_ALIGN - 1;
+    if (cls >= SLAB_CLASSES) {
+        metric_inc(&arena_misses);
+        return malloc(size);
+    }
+    if (slab_local[cls] == NULL) {
+        slab_local[cls] = __atomic_exchange_n(&slab_shared[cls], NULL, __ATOMIC_ACQUIRE);
+        if (slab_local[cls] == NULL) {
+            metric_inc(&arena_misses);
+            slab_refill(cls);
+            if (slab_local[cls] == NULL)
+                return NULL;
+        }
+    }
+    metric_inc(&arena_hits);
+    obj = slab_local[cls];
+    slab_local[cls] = obj->next;
+    return obj;
+}
+
+void
+slab_free(void *p, size_t size)
+{
+    struct slab_object  *obj = p;
+    size_t               cls;
+
+    cls = (size + SLAB_ALIGN - 1) / SLAB_ALIGN - 1;
+    if (cls >= SLAB_CLASSES) {
+        free(p);
+        return;
+    }
+    obj->next = __atomic_load_n(&slab_shared[cls], __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&slab_shared[cls], &obj->next, obj, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+void
+arena_stats(struct metric_buf *mb)
+{
+    metric_emit_counter(mb, "arena.hits", NULL, metric_value(&arena_hits));
+    metric_emit_counter(mb, "arena.misses", NULL, metric_value(&arena_misses));
+    metric_emit(mb, "arena.resident", NULL, __atomic_load_n(&arena_resident, __ATOMIC_RELAXED));
+}
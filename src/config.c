@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/param.h>
 #include <string.h>
 #include <stdlib.h>
 #include <bsd/string.h>
@@ -22,18 +23,21 @@
 #define MAX_ARGS 10
 
 static void     config_apply(struct unklog *, char *, int, const char *[]);
+static void     config_apply_dispatch(struct unklog *, char * , int, const char *[]);
 static void     config_apply_stats(struct unklog *, char * , int, const char *[]);
+static void     config_apply_prometheus(struct unklog *, char * , int, const char *[]);
 static void     config_apply_input(struct unklog *, char * , int, const char *[]);
 static void     config_apply_output(struct unklog *, char *, int, const char *[]);
 static void     config_apply_log(struct unklog *, char *, int, const char *[]);
 static void     config_apply_unknown(struct unklog *, char *, int, const char *[]);
 static void     config_parse_line(struct unklog *, char *);
+static int      config_output_option(struct output *, struct option *);
 
 void
 config_apply_stats(struct unklog *uk, char *cmdline, int argc, const char *argv[])
 {
     uk->mport = 6789;
-    (void)strlcpy(uk->maddr, "localhost", sizeof(uk->maddr));
+    (void)strlcpy(uk->maddr, "127.0.0.1", sizeof(uk->maddr));
     uk->mrun = 1;
 
     if (argc >= 1) {
@@ -46,6 +50,83 @@ config_apply_stats(struct unklog *uk, char *cmdline, int argc, const char *argv[
     log_info("config_apply_stats: setting up statistics on %s:%d", uk->maddr, uk->mport);
 }
 
+void
+config_apply_prometheus(struct unklog *uk, char *cmdline, int argc, const char *argv[])
+{
+    uk->pport = 9419;
+    (void)strlcpy(uk->paddr, "127.0.0.1", sizeof(uk->paddr));
+    uk->prun = 1;
+
+    if (argc >= 1) {
+        (void)strlcpy(uk->paddr, argv[0], sizeof(uk->paddr));
+    }
+
+    if (argc >= 2) {
+        uk->pport = atoi(argv[1]);
+    }
+    log_info("config_apply_prometheus: serving metrics on %s:%d", uk->paddr, uk->pport);
+}
+
+void
+config_apply_dispatch(struct unklog *uk, char *cmdline, int argc, const char *argv[])
+{
+    int          i;
+    size_t       off;
+    char         key[KEY_MAX];
+    const char  *val;
+
+    for (i = 0; i < argc; i++) {
+        off = strcspn(argv[i], "=");
+        (void)strlcpy(key, argv[i], MIN(off + 1, sizeof(key)));
+        val = argv[i] + off + (argv[i][off] == '=');
+
+        if (strcasecmp(key, "validate") == 0) {
+            if (strcasecmp(val, "full") == 0) {
+                uk->validate = VALIDATE_FULL;
+            } else if (strcasecmp(val, "lazy") == 0) {
+                uk->validate = VALIDATE_LAZY;
+            } else {
+                log_fatal("config_apply_dispatch: invalid validation mode: %s", val);
+            }
+        } else if (strcasecmp(key, "scan") == 0) {
+            uk->scan = strtoul(val, NULL, 10);
+        } else if (strcasecmp(key, "arena_chunk") == 0) {
+            uk->arena_chunk = strtoull(val, NULL, 10);
+        } else if (strcasecmp(key, "hugepages") == 0) {
+            if (strcasecmp(val, "yes") == 0) {
+                uk->hugepages = 1;
+            } else if (strcasecmp(val, "no") == 0) {
+                uk->hugepages = 0;
+            } else {
+                log_fatal("config_apply_dispatch: invalid hugepages setting: %s", val);
+            }
+        } else if (strcasecmp(key, "memory_limit") == 0) {
+            uk->memory_limit = strtoull(val, NULL, 10);
+        } else if (strcasecmp(key, "memory_policy") == 0) {
+            if (strcasecmp(val, "block") == 0) {
+                uk->memory_policy = MEMORY_BLOCK;
+            } else if (strcasecmp(val, "drop-oldest") == 0) {
+                uk->memory_policy = MEMORY_DROP_OLDEST;
+            } else if (strcasecmp(val, "drop-type") == 0) {
+                uk->memory_policy = MEMORY_DROP_TYPE;
+            } else {
+                log_fatal("config_apply_dispatch: invalid memory policy: %s", val);
+            }
+        } else if (strcasecmp(key, "drop_type") == 0) {
+            if (uk->ndrop_types == MEMORY_TYPES)
+                log_fatal("config_apply_dispatch: too many drop types");
+            (void)strlcpy(uk->drop_types[uk->ndrop_types++], val, TYPE_MAX);
+            uk->memory_policy = MEMORY_DROP_TYPE;
+        } else {
+            log_fatal("config_apply_dispatch: unknown option: %s", key);
+        }
+    }
+    log_info("config_apply_dispatch: %s validation, scanning %zu bytes",
+             (uk->validate == VALIDATE_FULL) ? "full" : "lazy", uk->scan);
+    if (uk->memory_limit > 0)
+        log_info("config_apply_dispatch: limiting payloads to %zu bytes", uk->memory_limit);
+}
+
 void
 config_apply_input(struct unklog *uk, char *cmdline, int argc, const char *argv[])
 {
@@ -79,6 +160,62 @@ config_apply_input(struct unklog *uk, char *cmdline, int argc, const char *argv[
     TAILQ_INSERT_TAIL(&uk->inputs, in, entry);
 }
 
+/*
+ * Remove key=value words from a command line, for options which are
+ * not meant for the command run by the exec output.
+ */
+void
+config_strip(char *cmdline, const char *key)
+{
+    char    *p = cmdline;
+    size_t   klen = strlen(key);
+    size_t   len;
+
+    while (*p != '\0') {
+        len = strcspn(p, " \t\r");
+        if (len > klen && p[klen] == '=' && strncasecmp(p, key, klen) == 0) {
+            len += strspn(p + len, " \t\r");
+            memmove(p, p + len, strlen(p + len) + 1);
+            continue;
+        }
+        p += len;
+        p += strspn(p, " \t\r");
+    }
+}
+
+/*
+ * Options which apply to all outputs are handled here and not passed
+ * down to the output implementation, nor to the command line.
+ */
+int
+config_output_option(struct output *out, struct option *opt)
+{
+    if (strcasecmp(opt->key, "max_queue_items") == 0) {
+        out->max_items = strtoul(opt->val, NULL, 10);
+    } else if (strcasecmp(opt->key, "max_queue_bytes") == 0) {
+        out->max_bytes = strtoul(opt->val, NULL, 10);
+    } else if (strcasecmp(opt->key, "batch") == 0) {
+        out->batch = strtoul(opt->val, NULL, 10);
+    } else if (strcasecmp(opt->key, "workers") == 0) {
+        out->nworkers = strtoul(opt->val, NULL, 10);
+    } else if (strcasecmp(opt->key, "ordering") == 0) {
+        if (strcasecmp(opt->val, "partition") == 0) {
+            out->flags |= OUTPUT_ORDERED;
+        } else if (strcasecmp(opt->val, "none") == 0) {
+            out->flags &= ~OUTPUT_ORDERED;
+        } else {
+            log_fatal("config_output_option: invalid ordering: %s", opt->val);
+        }
+    } else if (strcasecmp(opt->key, "spill") == 0) {
+        (void)strlcpy(out->spill_dir, opt->val, sizeof(out->spill_dir));
+    } else if (strcasecmp(opt->key, "spill_segment") == 0) {
+        out->spill_segment = strtoul(opt->val, NULL, 10);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
 void
 config_apply_output(struct unklog *uk, char *cmdline, int argc, const char *argv[])
 {
@@ -96,6 +233,8 @@ config_apply_output(struct unklog *uk, char *cmdline, int argc, const char *argv
         out->impl = &es_output;
     } else if (strcasecmp(argv[0], "exec") == 0) {
         out->impl = &exec_output;
+    } else if (strcasecmp(argv[0], "file") == 0) {
+        out->impl = &file_output;
     } else {
         log_fatal("config_apply_output: unsupported output method: %s", argv[0]);
     }
@@ -107,6 +246,11 @@ config_apply_output(struct unklog *uk, char *cmdline, int argc, const char *argv
         off++;
         (void)strlcpy(opt->key, argv[i], off);
         (void)strlcpy(opt->val, argv[i] + off, sizeof(opt->val));
+        if (config_output_option(out, opt)) {
+            config_strip(out->cmdline, opt->key);
+            free(opt);
+            continue;
+        }
         TAILQ_INSERT_TAIL(&out->options, opt, entry);
     }
     TAILQ_INSERT_TAIL(&uk->outputs, out, entry);
@@ -153,9 +297,11 @@ config_apply(struct unklog *uk, char *cmdline, int argc, const char *argv[])
         void    (*apply)(struct unklog *, char *, int, const char *[]);
         int      argcount;
     }            commands[] = {
+        { "dispatch",   config_apply_dispatch,  1 },
         { "input",      config_apply_input,     1 },
         { "log",        config_apply_log,       2 },
         { "output",     config_apply_output,    1 },
+        { "prometheus", config_apply_prometheus, 0 },
         { "stats",      config_apply_stats,     0 },
         { NULL,         config_apply_unknown,   0 }
     };
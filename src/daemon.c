@@ -50,6 +50,7 @@ void
 daemon_shutdown(struct unklog *uk)
 {
     log_warn("daemon_shutdown: stopping all inputs");
+    __atomic_store_n(&uk->stopping, 1, __ATOMIC_RELEASE);
     input_stop(uk);
 
     log_warn("daemon_shutdown: stopping all outputs");
@@ -57,6 +58,7 @@ daemon_shutdown(struct unklog *uk)
 
     log_debug("daemon_shutdown: stopping event loop");
     uv_stop(&uk->loop);
+    log_flush();
     _exit(0);
 }
 
@@ -75,12 +77,11 @@ daemon_run(struct unklog *uk)
     uk->sighup.data = uk;
     uk->sigterm.data = uk;
     uk->sigint.data = uk;
-    uv_timer_start(&uk->tick, metric_flush, 0, 5000);
+    uv_timer_start(&uk->tick, metric_flush, 0, METRIC_INTERVAL);
     uv_signal_start(&uk->sighup, daemon_signal, SIGHUP);
     uv_signal_start(&uk->sigterm, daemon_signal, SIGTERM);
     uv_signal_start(&uk->sigint, daemon_signal, SIGINT);
-    if (uk->mrun)
-        metric_start(uk);
+    metric_start(uk);
     uv_run(&uk->loop, UV_RUN_DEFAULT);
 }
 
@@ -89,18 +90,27 @@ daemon_init(struct unklog *uk)
 {
     bzero(uk, sizeof (*uk));
     metric_counter_init(&uk->count);
+    metric_counter_init(&uk->dropped);
     uk->uptime = time(NULL);
-    uv_mutex_init(&uk->mlock);
+    uk->validate = VALIDATE_FULL;
+    uk->scan = DEFAULT_SCAN;
 
     TAILQ_INIT(&uk->inputs);
     TAILQ_INIT(&uk->outputs);
 
     log_init(LOG_INFO, NULL);
+    scan_init();
     uv_loop_init(&uk->loop);
     uv_timer_init(&uk->loop, &uk->tick);
     uv_signal_init(&uk->loop, &uk->sighup);
     uv_signal_init(&uk->loop, &uk->sigterm);
     uv_signal_init(&uk->loop, &uk->sigint);
+
+    /*
+     * Writes to exited children and closed sockets are reported as
+     * errors instead.
+     */
+    (void)signal(SIGPIPE, SIG_IGN);
 }
 
 int
@@ -195,8 +205,11 @@ main(int argc, char *argv[])
         }
     }
 
+    log_start();
     log_info("main: starting workload");
 
+    arena_init(uk.arena_chunk, uk.hugepages);
+
     output_start(&uk);
     input_start(&uk);
     daemon_run(&uk);
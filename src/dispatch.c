@@ -16,57 +16,287 @@
 
 #include <string.h>
 #include <stdlib.h>
-#include <yajl/yajl_tree.h>
+#include <bsd/string.h>
+#include <yajl/yajl_parse.h>
 #include "unklog.h"
 
+#define DISPATCH_TOOLONG    0x01
+#define DISPATCH_WANT       0x02
+#define DISPATCH_FOUND      0x04
+
+struct dispatch_state {
+    int          flags;
+    int          depth;
+    char         type[TYPE_MAX];
+};
+
+static int  dispatch_start(void *);
+static int  dispatch_end(void *);
+static int  dispatch_key(void *, const unsigned char *, size_t);
+static int  dispatch_string(void *, const unsigned char *, size_t);
+static int  dispatch_scalar(void *);
+static int  dispatch_boolean(void *, int);
+static int  dispatch_number(void *, const char *, size_t);
+static int  dispatch_type(struct unklog *, const char *, size_t, char *);
+static int  dispatch_admit(struct unklog *, const char *, size_t);
+static int  dispatch_message(struct unklog *, struct message *);
+
+static yajl_callbacks dispatch_callbacks = {
+    dispatch_scalar,
+    dispatch_boolean,
+    NULL,
+    NULL,
+    dispatch_number,
+    dispatch_string,
+    dispatch_start,
+    dispatch_key,
+    dispatch_end,
+    dispatch_start,
+    dispatch_end
+};
+
 int
-dispatch_payload(const char *buf, size_t len, void *p)
+dispatch_start(void *p)
 {
-    struct unklog   *uk = p;
-    yajl_val         node;
-    yajl_val         type;
-    char             ebuf[512];
-    const char      *path[] = {"type", NULL};
-    struct payload  *payload;
-    struct output   *out;
+    struct dispatch_state   *ds = p;
 
-    log_trace("dispatch_payload: enter");
-    node = yajl_tree_parse(buf, ebuf, sizeof(ebuf));
+    ds->flags &= ~DISPATCH_WANT;
+    ds->depth++;
+    return 1;
+}
+
+int
+dispatch_end(void *p)
+{
+    struct dispatch_state   *ds = p;
+
+    ds->depth--;
+    return 1;
+}
+
+int
+dispatch_key(void *p, const unsigned char *key, size_t len)
+{
+    struct dispatch_state   *ds = p;
+
+    if (ds->depth == 1 && len == 4 && memcmp(key, "type", 4) == 0)
+        ds->flags |= DISPATCH_WANT;
+    else
+        ds->flags &= ~DISPATCH_WANT;
+    return 1;
+}
+
+int
+dispatch_string(void *p, const unsigned char *val, size_t len)
+{
+    struct dispatch_state   *ds = p;
+
+    if (!(ds->flags & DISPATCH_WANT) || (ds->flags & DISPATCH_FOUND))
+        return 1;
+
+    ds->flags &= ~DISPATCH_WANT;
+    ds->flags |= DISPATCH_FOUND;
+    if (len >= sizeof(ds->type)) {
+        ds->flags |= DISPATCH_TOOLONG;
+    } else {
+        memcpy(ds->type, val, len);
+        ds->type[len] = '\0';
+    }
+    /*
+     * Validation happens beforehand, there is no point in
+     * going any further.
+     */
+    return 0;
+}
+
+int
+dispatch_scalar(void *p)
+{
+    struct dispatch_state   *ds = p;
+
+    ds->flags &= ~DISPATCH_WANT;
+    return 1;
+}
+
+int
+dispatch_boolean(void *p, int val)
+{
+    return dispatch_scalar(p);
+}
+
+int
+dispatch_number(void *p, const char *val, size_t len)
+{
+    return dispatch_scalar(p);
+}
+
+/*
+ * Look for the top-level type of a message without building a tree.
+ * In full validation mode the whole message is first checked by the
+ * structural scanner, parsing then stops as soon as the type is
+ * found. In lazy mode at most uk->scan bytes are looked at. Returns
+ * -1 for messages which are rejected, 1 when out of memory.
+ */
+int
+dispatch_type(struct unklog *uk, const char *buf, size_t len, char *type)
+{
+    struct dispatch_state    ds;
+    yajl_handle              h;
+    yajl_status              st;
+    unsigned char           *err;
+
+    bzero(&ds, sizeof(ds));
+    if (uk->validate == VALIDATE_FULL) {
+        if (scan_validate(buf, len) != 0) {
+            log_warn("dispatch_type: bad message");
+            return -1;
+        }
+    } else if (uk->scan > 0 && len > uk->scan) {
+        len = uk->scan;
+    }
 
-    if (node == NULL) {
-        log_warn("dispatch_payload: bad message: %s", ebuf);
+    if ((h = yajl_alloc(&dispatch_callbacks, NULL, &ds)) == NULL) {
+        log_sys_error("dispatch_type: out of memory");
+        return 1;
+    }
+    (void)yajl_config(h, yajl_dont_validate_strings, 1);
+    st = yajl_parse(h, (const unsigned char *)buf, len);
+
+    if (st == yajl_status_error) {
+        err = yajl_get_error(h, 0, (const unsigned char *)buf, len);
+        log_warn("dispatch_type: bad message: %s", err);
+        yajl_free_error(h, err);
+        yajl_free(h);
         return -1;
     }
+    yajl_free(h);
 
-    metric_inc(&uk->count);
-    type = yajl_tree_get(node, path, yajl_t_string);
-    if (type == NULL) {
-        log_warn("dispatch_payload: no type in message");
-        yajl_tree_free(node);
+    if (!(ds.flags & DISPATCH_FOUND)) {
+        log_warn("dispatch_type: no type in message");
         return -1;
     }
-    TAILQ_FOREACH(out, &uk->outputs, entry) {
-        if ((payload = calloc(1, sizeof(*payload))) == NULL) {
-            log_sys_error("dispatch_payload: out of memory");
-            continue;
-        }
-        if ((payload->buf = strdup(buf)) == NULL) {
-            log_sys_error("dispatch_payload: out of memory");
-            free(payload);
-            continue;
+    if (ds.flags & DISPATCH_TOOLONG) {
+        log_warn("dispatch_type: type too long in message");
+        return -1;
+    }
+    (void)strlcpy(type, ds.type, TYPE_MAX);
+    return 0;
+}
+
+/*
+ * Enforce the memory limit before a payload is allocated. Returns -1
+ * when the message should be dropped, 1 when it should be handed over
+ * again later, once enough payloads have been released. Inputs hold
+ * on to it and pause in the meantime, rather than blocking here. With
+ * drop-oldest, workers shed the head of their queues instead and new
+ * messages are always let in.
+ */
+int
+dispatch_admit(struct unklog *uk, const char *type, size_t len)
+{
+    size_t           used;
+    size_t           i;
+
+    if (uk->memory_limit == 0)
+        return 0;
+    if ((used = payload_memory()) + len <= uk->memory_limit)
+        return 0;
+    if (uk->memory_policy == MEMORY_DROP_OLDEST)
+        return 0;
+    if (uk->memory_policy == MEMORY_DROP_TYPE) {
+        for (i = 0; i < uk->ndrop_types; i++) {
+            if (strcmp(type, uk->drop_types[i]) == 0)
+                return -1;
         }
-        if ((payload->type = strdup(YAJL_GET_STRING(type))) == NULL) {
-            log_sys_error("dispatch_payload: out of memory");
-            free(payload->buf);
-            free(payload);
+    }
+
+    if (!__atomic_exchange_n(&uk->memory_full, 1, __ATOMIC_ACQ_REL)) {
+        __atomic_add_fetch(&uk->congested, 1, __ATOMIC_RELEASE);
+        log_debug("dispatch_admit: over memory limit, %zu bytes used", used);
+    }
+
+    /*
+     * A single message larger than the limit still goes through once
+     * everything else has been released.
+     */
+    return (used > 0) ? 1 : 0;
+}
+
+int
+dispatch_message(struct unklog *uk, struct message *msg)
+{
+    char             type[TYPE_MAX];
+    struct payload  *payload;
+    struct output   *out;
+    int              res;
+
+    if ((res = dispatch_type(uk, msg->buf, msg->len, type)) != 0)
+        return res;
+
+    if ((res = dispatch_admit(uk, type, msg->len)) > 0)
+        return 1;
+    if (res != 0) {
+        metric_inc(&uk->dropped);
+        if (msg->tracker != NULL)
+            tracker_ack(msg->tracker, msg->seq);
+        return 0;
+    }
+    if (uk->outcount == 0) {
+        metric_inc(&uk->count);
+        if (msg->tracker != NULL)
+            tracker_ack(msg->tracker, msg->seq);
+        return 0;
+    }
+
+    /*
+     * Running out of memory is no reason to lose the message, it is
+     * held like one over the memory limit and offered again later.
+     */
+    if ((payload = payload_new(msg->buf, msg->len, uk->outcount)) == NULL) {
+        log_sys_error("dispatch_message: out of memory");
+        return 1;
+    }
+    metric_inc(&uk->count);
+    payload->partition = msg->partition;
+    payload->tracker = msg->tracker;
+    payload->seq = msg->seq;
+    payload->timestamp = msg->timestamp;
+    payload->received = msg->received;
+    payload->enqueued = uv_hrtime();
+    (void)strlcpy(payload->type, type, sizeof(payload->type));
+
+    TAILQ_FOREACH(out, &uk->outputs, entry) {
+        output_push(out, payload);
+    }
+    return 0;
+}
+
+/*
+ * Returns the number of messages taken, the following ones are to be
+ * handed over again later.
+ */
+int
+dispatch_payload(struct message *msgs, size_t count, void *p)
+{
+    struct unklog   *uk = p;
+    size_t           i;
+    int              res;
+
+    log_trace("dispatch_payload: enter");
+    for (i = 0; i < count; i++) {
+        if ((res = dispatch_message(uk, &msgs[i])) == 0)
             continue;
+        if (res > 0) {
+            log_trace("dispatch_payload: holding %zu messages", count - i);
+            break;
         }
-        payload->len = strlen(buf);
-        uv_mutex_lock(&out->lock);
-        STAILQ_INSERT_TAIL(&out->payloads, payload, entry);
-        uv_cond_signal(&out->signal);
-        uv_mutex_unlock(&out->lock);
+        /*
+         * Rejected messages will never make it to an output, there
+         * is no reason to hold their offset back.
+         */
+        if (msgs[i].tracker != NULL)
+            tracker_ack(msgs[i].tracker, msgs[i].seq);
     }
     log_trace("dispatch_payload: success");
-    return 0;
+    return i;
 }
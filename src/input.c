@@ -49,6 +49,7 @@ input_stop(struct unklog *uk)
     log_trace("input_stop: enter");
     TAILQ_FOREACH(in, &uk->inputs, entry) {
         in->impl->stop(in);
+        (void)uv_thread_join(&in->thread);
     }
     log_trace("input_stop: leave");
 }
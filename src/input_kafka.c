@@ -18,6 +18,7 @@
 #include <string.h>
 #include <bsd/string.h>
 #include <librdkafka/rdkafka.h>
+#include <yajl/yajl_tree.h>
 
 #include "unklog.h"
 
@@ -26,12 +27,75 @@ static int  kafka_stop(struct input *);
 static void kafka_log(const rd_kafka_t *, int, const char *, const char *);
 static void kafka_rebalance(rd_kafka_t *, rd_kafka_resp_err_t,
                             rd_kafka_topic_partition_list_t *, void *);
+static void kafka_pause(struct input *);
+static void kafka_resume(struct input *);
+static void kafka_forget(struct input *);
+static void kafka_queues(struct input *, rd_kafka_topic_partition_list_t *);
+static void kafka_handle(struct input *, rd_kafka_message_t **, size_t,
+                         input_dispatch_t, void *);
+static int  kafka_dispatch(struct input *, input_dispatch_t, void *);
+static void kafka_release(struct input *);
+static int  kafka_consume(struct input *, rd_kafka_queue_t *, int,
+                          input_dispatch_t, void *);
+static struct tracker *kafka_tracker(struct input *, const char *, int32_t);
+static void kafka_commit(struct input *, int);
+static int  kafka_stats_cb(rd_kafka_t *, char *, size_t, void *);
+static int64_t kafka_stats_int(yajl_val, const char *);
+static void kafka_stats_parse(struct input *, char *);
+static void kafka_stats(struct input *, struct metric_buf *);
+
+#define KAFKA_POLL      300
+#define KAFKA_HOLD      10
+#define KAFKA_COMMIT    5000
+#define KAFKA_NAME_MAX  256
+
+/*
+ * Figures from the last librdkafka statistics, for each assigned
+ * partition and each broker.
+ */
+struct kafka_partition_stats {
+    char                             topic[KAFKA_NAME_MAX];
+    int32_t                          partition;
+    int64_t                          lag;
+    int64_t                          committed;
+    int64_t                          fetchq_cnt;
+    int64_t                          fetchq_size;
+};
+
+struct kafka_broker_stats {
+    int32_t                          id;
+    int64_t                          rtt;
+    int64_t                          rtt_p99;
+};
 
 struct kafka_state {
     rd_kafka_conf_t                 *conf;
     rd_kafka_topic_conf_t           *tconf;
     rd_kafka_topic_partition_list_t *topics;
+    rd_kafka_topic_partition_list_t *paused;
     rd_kafka_t                      *rd;
+    size_t                           batch;
+    int                              per_partition;
+    rd_kafka_queue_t                *queue;
+    rd_kafka_queue_t               **queues;
+    int                              nqueues;
+    rd_kafka_message_t             **msgs;
+    rd_kafka_message_t             **held;
+    size_t                           nheld;
+    size_t                           held_size;
+    struct message                  *vec;
+    size_t                           nvec;
+    size_t                           dispatched;
+    struct tracker                 **trackers;
+    int                              ntrackers;
+    struct tracker                  *last;
+    uint64_t                         commit_interval;
+    uint64_t                         committed_at;
+    char                            *stats_json;
+    struct kafka_partition_stats    *pstats;
+    size_t                           npstats;
+    struct kafka_broker_stats       *bstats;
+    size_t                           nbstats;
 };
 
 void
@@ -40,43 +104,475 @@ kafka_log(const rd_kafka_t *rd, int level, const char *fac, const char *buf)
     log_print(level, 0, "%s: kafka message: %s", fac, buf);
 }
 
+/*
+ * Called from the consumer thread while polling. Only the latest
+ * statistics are kept, they are parsed on the loop thread when
+ * statistics are rendered.
+ */
+int
+kafka_stats_cb(rd_kafka_t *rd, char *json, size_t len, void *opaque)
+{
+    struct input        *in = opaque;
+    struct kafka_state  *k = in->state;
+    char                *old;
+
+    old = __atomic_exchange_n(&k->stats_json, json, __ATOMIC_ACQ_REL);
+    if (old != NULL)
+        rd_kafka_mem_free(rd, old);
+    return 1;
+}
+
+int64_t
+kafka_stats_int(yajl_val v, const char *key)
+{
+    const char  *path[] = { key, NULL };
+
+    v = yajl_tree_get(v, path, yajl_t_number);
+    return YAJL_IS_INTEGER(v) ? YAJL_GET_INTEGER(v) : -1;
+}
+
+void
+kafka_stats_parse(struct input *in, char *json)
+{
+    struct kafka_state  *k = in->state;
+    const char          *brokers_path[] = { "brokers", NULL };
+    const char          *topics_path[] = { "topics", NULL };
+    const char          *parts_path[] = { "partitions", NULL };
+    const char          *avg_path[] = { "rtt", "avg", NULL };
+    const char          *p99_path[] = { "rtt", "p99", NULL };
+    const char          *assigned_path[] = { "assigned", NULL };
+    char                 err[128];
+    yajl_val             root;
+    yajl_val             brokers;
+    yajl_val             topics;
+    yajl_val             parts;
+    yajl_val             part;
+    yajl_val             rtt;
+    yajl_val             v;
+    size_t               i;
+    size_t               j;
+    size_t               n;
+    void                *tmp;
+    int32_t              partition;
+
+    if ((root = yajl_tree_parse(json, err, sizeof(err))) == NULL) {
+        log_warn("kafka_stats_parse: invalid statistics: %s", err);
+        return;
+    }
+
+    k->npstats = 0;
+    topics = yajl_tree_get(root, topics_path, yajl_t_object);
+    for (i = 0; topics != NULL && i < topics->u.object.len; i++) {
+        parts = yajl_tree_get(topics->u.object.values[i], parts_path, yajl_t_object);
+        if (parts == NULL || parts->u.object.len == 0)
+            continue;
+        n = k->npstats + parts->u.object.len;
+        if ((tmp = realloc(k->pstats, n * sizeof(*k->pstats))) == NULL)
+            log_sys_fatal("kafka_stats_parse: out of memory");
+        k->pstats = tmp;
+        for (j = 0; j < parts->u.object.len; j++) {
+            part = parts->u.object.values[j];
+
+            /*
+             * Partition -1 holds messages not yet assigned to a
+             * partition, skip it along with unassigned partitions.
+             */
+            partition = strtol(parts->u.object.keys[j], NULL, 10);
+            v = yajl_tree_get(part, assigned_path, yajl_t_any);
+            if (partition < 0 || YAJL_IS_FALSE(v))
+                continue;
+            (void)strlcpy(k->pstats[k->npstats].topic, topics->u.object.keys[i],
+                          sizeof(k->pstats[k->npstats].topic));
+            k->pstats[k->npstats].partition = partition;
+            k->pstats[k->npstats].lag = kafka_stats_int(part, "consumer_lag");
+            k->pstats[k->npstats].committed = kafka_stats_int(part, "committed_offset");
+            k->pstats[k->npstats].fetchq_cnt = kafka_stats_int(part, "fetchq_cnt");
+            k->pstats[k->npstats].fetchq_size = kafka_stats_int(part, "fetchq_size");
+            k->npstats++;
+        }
+    }
+
+    k->nbstats = 0;
+    brokers = yajl_tree_get(root, brokers_path, yajl_t_object);
+    if (brokers != NULL && brokers->u.object.len > 0) {
+        n = brokers->u.object.len;
+        if ((tmp = realloc(k->bstats, n * sizeof(*k->bstats))) == NULL)
+            log_sys_fatal("kafka_stats_parse: out of memory");
+        k->bstats = tmp;
+        for (i = 0; i < n; i++) {
+            v = brokers->u.object.values[i];
+
+            /*
+             * Bootstrap brokers have no id until metadata comes in.
+             */
+            if (kafka_stats_int(v, "nodeid") < 0)
+                continue;
+            k->bstats[k->nbstats].id = kafka_stats_int(v, "nodeid");
+            rtt = yajl_tree_get(v, avg_path, yajl_t_number);
+            k->bstats[k->nbstats].rtt = YAJL_IS_INTEGER(rtt) ? YAJL_GET_INTEGER(rtt) : 0;
+            rtt = yajl_tree_get(v, p99_path, yajl_t_number);
+            k->bstats[k->nbstats].rtt_p99 = YAJL_IS_INTEGER(rtt) ? YAJL_GET_INTEGER(rtt) : 0;
+            k->nbstats++;
+        }
+    }
+    yajl_tree_free(root);
+}
+
+/*
+ * Runs on the loop thread, statistics are parsed here rather than in
+ * the consumer thread, and only when new ones came in.
+ */
+void
+kafka_stats(struct input *in, struct metric_buf *mb)
+{
+    struct kafka_state  *k = in->state;
+    const char          *labels[5];
+    char                 part[16];
+    char                 id[16];
+    char                *json;
+    size_t               i;
+
+    if (k == NULL)
+        return;
+    if ((json = __atomic_exchange_n(&k->stats_json, NULL, __ATOMIC_ACQ_REL)) != NULL) {
+        kafka_stats_parse(in, json);
+        rd_kafka_mem_free(NULL, json);
+    }
+
+    labels[0] = "topic";
+    labels[2] = "partition";
+    labels[3] = part;
+    labels[4] = NULL;
+    for (i = 0; i < k->npstats; i++) {
+        labels[1] = k->pstats[i].topic;
+        snprintf(part, sizeof(part), "%d", k->pstats[i].partition);
+        metric_emit(mb, "consumer_lag", labels, k->pstats[i].lag);
+        metric_emit(mb, "committed_offset", labels, k->pstats[i].committed);
+        metric_emit(mb, "fetchq_cnt", labels, k->pstats[i].fetchq_cnt);
+        metric_emit(mb, "fetchq_size", labels, k->pstats[i].fetchq_size);
+    }
+
+    labels[0] = "broker";
+    labels[1] = id;
+    labels[2] = NULL;
+    for (i = 0; i < k->nbstats; i++) {
+        snprintf(id, sizeof(id), "%d", k->bstats[i].id);
+        metric_emit(mb, "rtt", labels, k->bstats[i].rtt);
+        metric_emit(mb, "rtt.p99", labels, k->bstats[i].rtt_p99);
+    }
+}
+
 void
 kafka_rebalance(rd_kafka_t *rd,
                 rd_kafka_resp_err_t err,
                 rd_kafka_topic_partition_list_t *partitions,
                 void *opaque)
 {
+    struct input        *in = opaque;
+    struct kafka_state  *k = in->state;
+
     log_info("kafka_rebalance: consumer group rebalanced");
     switch (err) {
     case RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS:
         log_info("kafka_rebalance: new assignment");
         rd_kafka_assign(rd, partitions);
+        if (k->per_partition)
+            kafka_queues(in, partitions);
+        if (output_congested(in->uk))
+            kafka_pause(in);
         break;
     case RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS:
         log_info("kafka_rebalance: partitions revoked");
+        kafka_commit(in, 1);
+        kafka_release(in);
         rd_kafka_assign(rd, NULL);
+        kafka_queues(in, NULL);
+        kafka_forget(in);
         break;
     default:
         log_error("kafka_rebalance: bad state");
         rd_kafka_assign(rd, NULL);
+        kafka_queues(in, NULL);
+        kafka_forget(in);
         break;
     }
 }
 
+struct tracker *
+kafka_tracker(struct input *in, const char *topic, int32_t partition)
+{
+    struct kafka_state  *k = in->state;
+    struct tracker     **trackers;
+    int                  i;
+
+    if (k->last != NULL &&
+        k->last->partition == partition &&
+        strcmp(k->last->topic, topic) == 0)
+        return k->last;
+
+    for (i = 0; i < k->ntrackers; i++) {
+        if (k->trackers[i]->partition == partition &&
+            strcmp(k->trackers[i]->topic, topic) == 0) {
+            k->last = k->trackers[i];
+            return k->last;
+        }
+    }
+
+    /*
+     * Trackers are never freed since payloads from a revoked
+     * partition may still be in flight, they are reset instead.
+     */
+    trackers = realloc(k->trackers, (k->ntrackers + 1) * sizeof(*trackers));
+    if (trackers == NULL)
+        log_sys_fatal("kafka_tracker: out of memory");
+    k->trackers = trackers;
+    k->last = k->trackers[k->ntrackers++] = tracker_new(topic, partition);
+    return k->last;
+}
+
+/*
+ * Commit the offsets of messages processed by every output. When
+ * sync is set, trackers are reset afterwards since this happens
+ * before partitions are revoked.
+ */
 void
-kafka_handle(struct input *in, rd_kafka_message_t *msg, input_dispatch_t fn, void *p)
+kafka_commit(struct input *in, int sync)
 {
-    if (msg->err) {
-        if (msg->err == RD_KAFKA_RESP_ERR__PARTITION_EOF) {
-            log_debug("kafka_handle: reached end of partition %ld",
-                      msg->partition);
-        } else {
-            log_error("kafka_handle: kafka error");
+    struct kafka_state              *k = in->state;
+    rd_kafka_topic_partition_list_t *offsets;
+    rd_kafka_topic_partition_t      *tp;
+    rd_kafka_resp_err_t              err;
+    int64_t                          position;
+    int                              i;
+
+    k->committed_at = uv_hrtime();
+    if ((offsets = rd_kafka_topic_partition_list_new(k->ntrackers)) == NULL)
+        log_sys_fatal("kafka_commit: out of memory");
+    for (i = 0; i < k->ntrackers; i++) {
+        position = tracker_position(k->trackers[i]);
+        if (position < 0 || position == k->trackers[i]->committed)
+            continue;
+        tp = rd_kafka_topic_partition_list_add(offsets,
+                                               k->trackers[i]->topic,
+                                               k->trackers[i]->partition);
+        tp->offset = position;
+        k->trackers[i]->committed = position;
+    }
+    if (offsets->cnt > 0) {
+        log_debug("kafka_commit: committing %d partitions", offsets->cnt);
+        if ((err = rd_kafka_commit(k->rd, offsets, !sync)) != RD_KAFKA_RESP_ERR_NO_ERROR)
+            log_error("kafka_commit: cannot commit offsets: %s", rd_kafka_err2str(err));
+    }
+    rd_kafka_topic_partition_list_destroy(offsets);
+
+    if (sync) {
+        for (i = 0; i < k->ntrackers; i++)
+            tracker_reset(k->trackers[i]);
+    }
+}
+
+/*
+ * In per-partition mode, each assigned partition gets its own queue
+ * which is no longer forwarded to the consumer queue, so partitions
+ * can be consumed independently from each other.
+ */
+void
+kafka_queues(struct input *in, rd_kafka_topic_partition_list_t *partitions)
+{
+    struct kafka_state  *k = in->state;
+    int                  i;
+
+    for (i = 0; i < k->nqueues; i++)
+        rd_kafka_queue_destroy(k->queues[i]);
+    free(k->queues);
+    k->queues = NULL;
+    k->nqueues = 0;
+
+    if (partitions == NULL || partitions->cnt == 0)
+        return;
+
+    if ((k->queues = calloc(partitions->cnt, sizeof(*k->queues))) == NULL)
+        log_sys_fatal("kafka_queues: out of memory");
+    for (i = 0; i < partitions->cnt; i++) {
+        k->queues[k->nqueues] = rd_kafka_queue_get_partition(k->rd,
+                                                             partitions->elems[i].topic,
+                                                             partitions->elems[i].partition);
+        if (k->queues[k->nqueues] == NULL) {
+            log_error("kafka_queues: no queue for %s:%d",
+                      partitions->elems[i].topic, partitions->elems[i].partition);
+            continue;
         }
+        rd_kafka_queue_forward(k->queues[k->nqueues], NULL);
+        k->nqueues++;
+    }
+    log_debug("kafka_queues: consuming from %d partition queues", k->nqueues);
+}
+
+/*
+ * Stop fetching from all assigned partitions while an output is over
+ * its queue limits. The consumer keeps polling so that it stays in
+ * the group.
+ */
+void
+kafka_pause(struct input *in)
+{
+    struct kafka_state  *k = in->state;
+    rd_kafka_resp_err_t  err;
+
+    if (k->paused != NULL)
+        return;
+    if ((err = rd_kafka_assignment(k->rd, &k->paused)) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        log_error("kafka_pause: cannot fetch assignment: %s", rd_kafka_err2str(err));
+        k->paused = NULL;
+        return;
+    }
+    if ((err = rd_kafka_pause_partitions(k->rd, k->paused)) != RD_KAFKA_RESP_ERR_NO_ERROR)
+        log_error("kafka_pause: cannot pause partitions: %s", rd_kafka_err2str(err));
+    log_info("kafka_pause: outputs are full, paused %d partitions", k->paused->cnt);
+}
+
+/*
+ * Drop the paused list once its partitions are no longer ours, they
+ * are not to be resumed. The next assignment is paused again if the
+ * outputs are still full.
+ */
+void
+kafka_forget(struct input *in)
+{
+    struct kafka_state  *k = in->state;
+
+    if (k->paused == NULL)
         return;
+    rd_kafka_topic_partition_list_destroy(k->paused);
+    k->paused = NULL;
+}
+
+void
+kafka_resume(struct input *in)
+{
+    struct kafka_state  *k = in->state;
+    rd_kafka_resp_err_t  err;
+
+    if (k->paused == NULL)
+        return;
+    if ((err = rd_kafka_resume_partitions(k->rd, k->paused)) != RD_KAFKA_RESP_ERR_NO_ERROR)
+        log_error("kafka_resume: cannot resume partitions: %s", rd_kafka_err2str(err));
+    log_info("kafka_resume: outputs drained, resumed %d partitions", k->paused->cnt);
+    rd_kafka_topic_partition_list_destroy(k->paused);
+    k->paused = NULL;
+}
+
+/*
+ * Messages are handed over to dispatch in the order they came. Those
+ * it cannot take yet, because of the memory limit, are held along with
+ * the ones following them and handed over again from the main loop.
+ */
+void
+kafka_handle(struct input *in, rd_kafka_message_t **msgs, size_t count,
+             input_dispatch_t fn, void *p)
+{
+    struct kafka_state  *k = in->state;
+    rd_kafka_message_t  *msg;
+    rd_kafka_message_t **held;
+    struct message      *vec;
+    size_t               i;
+    size_t               n = 0;
+    size_t               size;
+    uint64_t             now;
+
+    if (k->nheld + count > k->held_size) {
+        for (size = k->held_size * 2; size < k->nheld + count; size *= 2)
+            ;
+        if ((held = realloc(k->held, size * sizeof(*held))) == NULL)
+            log_sys_fatal("kafka_handle: out of memory");
+        k->held = held;
+        if ((vec = realloc(k->vec, size * sizeof(*vec))) == NULL)
+            log_sys_fatal("kafka_handle: out of memory");
+        k->vec = vec;
+        k->held_size = size;
+    }
+
+    now = metric_realtime();
+    for (i = 0; i < count; i++) {
+        msg = msgs[i];
+        k->held[k->nheld++] = msg;
+        if (msg->err) {
+            if (msg->err == RD_KAFKA_RESP_ERR__PARTITION_EOF) {
+                log_debug("kafka_handle: reached end of partition %d",
+                          msg->partition);
+            } else {
+                log_error("kafka_handle: kafka error");
+            }
+            continue;
+        }
+        vec = &k->vec[k->nvec++];
+        vec->buf = msg->payload;
+        vec->len = msg->len;
+        vec->partition = msg->partition;
+        vec->tracker = kafka_tracker(in, rd_kafka_topic_name(msg->rkt),
+                                     msg->partition);
+        vec->seq = tracker_add(vec->tracker, msg->offset);
+        vec->timestamp = rd_kafka_message_timestamp(msg, NULL);
+        vec->received = now;
+        n++;
     }
-    metric_inc(&in->count);
-    (void)fn((const char *)msg->payload, msg->len, p);
+    if (n > 0)
+        metric_add(&in->count, n);
+    (void)kafka_dispatch(in, fn, p);
+}
+
+/*
+ * Returns -1 while some messages are still held.
+ */
+int
+kafka_dispatch(struct input *in, input_dispatch_t fn, void *p)
+{
+    struct kafka_state  *k = in->state;
+
+    if (k->dispatched < k->nvec)
+        k->dispatched += fn(k->vec + k->dispatched, k->nvec - k->dispatched, p);
+    if (k->dispatched < k->nvec)
+        return -1;
+    kafka_release(in);
+    return 0;
+}
+
+/*
+ * Messages which were not dispatched are not acknowledged either,
+ * offsets are not committed past them.
+ */
+void
+kafka_release(struct input *in)
+{
+    struct kafka_state  *k = in->state;
+    size_t               i;
+
+    for (i = 0; i < k->nheld; i++)
+        rd_kafka_message_destroy(k->held[i]);
+    k->nheld = 0;
+    k->nvec = 0;
+    k->dispatched = 0;
+}
+
+/*
+ * Hand at most k->batch messages from a queue over to dispatch,
+ * returns the number of messages consumed.
+ */
+int
+kafka_consume(struct input *in, rd_kafka_queue_t *queue, int timeout,
+              input_dispatch_t fn, void *p)
+{
+    struct kafka_state  *k = in->state;
+    ssize_t              n;
+
+    n = rd_kafka_consume_batch_queue(queue, timeout, k->msgs, k->batch);
+    if (n == -1) {
+        log_error("kafka_consume: cannot consume batch");
+        return 0;
+    }
+    if (n > 0)
+        kafka_handle(in, k->msgs, n, fn, p);
+    return n;
 }
 
 int
@@ -87,6 +583,8 @@ kafka_start(struct input *in, input_dispatch_t fn, void *p)
     char                 estr[512];
     rd_kafka_message_t  *msg;
     char                *topic = NULL;
+    int                  i;
+    int                  n;
 
     log_trace("kafka_start: enter");
     if ((k = calloc(1, sizeof(*k))) == NULL) {
@@ -113,6 +611,16 @@ kafka_start(struct input *in, input_dispatch_t fn, void *p)
 
     rd_kafka_conf_set_log_cb(k->conf, kafka_log);
 
+    /*
+     * Statistics are on by default, for lag reporting. Setting
+     * statistics.interval.ms to 0 turns them off.
+     */
+    snprintf(estr, sizeof(estr), "%d", METRIC_INTERVAL);
+    if (rd_kafka_conf_set(k->conf, "statistics.interval.ms", estr,
+                          estr, sizeof(estr)) != RD_KAFKA_CONF_OK)
+        log_fatal("kafka_start: cannot enable statistics: %s", estr);
+    rd_kafka_conf_set_stats_cb(k->conf, kafka_stats_cb);
+
     log_trace("kafka_start: applying options");
 
     TAILQ_FOREACH(opt, &in->options, entry) {
@@ -123,6 +631,25 @@ kafka_start(struct input *in, input_dispatch_t fn, void *p)
             continue;
         }
 
+        if (strcasecmp(opt->key, "batch") == 0) {
+            k->batch = strtoul(opt->val, NULL, 10);
+            log_debug("kafka_start: consuming in batches of %zu", k->batch);
+            continue;
+        }
+
+        if (strcasecmp(opt->key, "commit_interval") == 0) {
+            k->commit_interval = strtoull(opt->val, NULL, 10);
+            continue;
+        }
+
+        if (strcasecmp(opt->key, "queues") == 0) {
+            if (strcasecmp(opt->val, "partition") == 0)
+                k->per_partition = 1;
+            else if (strcasecmp(opt->val, "consumer") != 0)
+                log_fatal("kafka_start: invalid queues: %s", opt->val);
+            continue;
+        }
+
         if (topic == NULL) {
             log_debug("kafka_start: applying global option: %s => %s", opt->key, opt->val);
             if (rd_kafka_conf_set(k->conf, opt->key, opt->val, estr, sizeof(estr)) != RD_KAFKA_CONF_OK)
@@ -140,8 +667,29 @@ kafka_start(struct input *in, input_dispatch_t fn, void *p)
         topic = "logs";
     }
 
+    /*
+     * Offsets are committed once all outputs are done with a
+     * message, librdkafka must not do it on its own.
+     */
+    if (rd_kafka_conf_set(k->conf, "enable.auto.commit", "false",
+                          estr, sizeof(estr)) != RD_KAFKA_CONF_OK)
+        log_fatal("kafka_start: cannot disable auto commit: %s", estr);
+    if (k->commit_interval == 0)
+        k->commit_interval = KAFKA_COMMIT;
+
+    if (k->batch == 0)
+        k->batch = 1;
+    if ((k->msgs = calloc(k->batch, sizeof(*k->msgs))) == NULL)
+        log_sys_fatal("kafka_start: out of memory");
+    if ((k->held = calloc(k->batch, sizeof(*k->held))) == NULL)
+        log_sys_fatal("kafka_start: out of memory");
+    if ((k->vec = calloc(k->batch, sizeof(*k->vec))) == NULL)
+        log_sys_fatal("kafka_start: out of memory");
+    k->held_size = k->batch;
+
     rd_kafka_conf_set_default_topic_conf(k->conf, k->tconf);
     rd_kafka_conf_set_rebalance_cb(k->conf, kafka_rebalance);
+    rd_kafka_conf_set_opaque(k->conf, in);
 
     if ((k->rd = rd_kafka_new(RD_KAFKA_CONSUMER, k->conf, estr, sizeof(estr))) == NULL)
         log_fatal("kafka_start: cannot create consumer: %s", estr);
@@ -154,14 +702,53 @@ kafka_start(struct input *in, input_dispatch_t fn, void *p)
     rd_kafka_topic_partition_list_add(k->topics, topic, -1);
 
     rd_kafka_subscribe(k->rd, k->topics);
+    if ((k->queue = rd_kafka_queue_get_consumer(k->rd)) == NULL)
+        log_fatal("kafka_start: cannot get consumer queue");
+
     log_trace("kafka_start: polling log messages");
-    while (in->flags & INPUT_RUN) {
-        if ((msg = rd_kafka_consumer_poll(k->rd, 300)) == NULL)
-            continue;
-        kafka_handle(in, msg, fn, p);
-        rd_kafka_message_destroy(msg);
+    while (__atomic_load_n(&in->flags, __ATOMIC_ACQUIRE) & INPUT_RUN) {
+        if (output_congested(in->uk))
+            kafka_pause(in);
+        else if (k->paused != NULL)
+            kafka_resume(in);
+
+        /*
+         * Messages held back by the memory limit go first. Until
+         * they are taken, partitions stay paused and the consumer is
+         * only polled to stay in the group.
+         */
+        if (k->nheld > 0 && kafka_dispatch(in, fn, p) != 0) {
+            if ((msg = rd_kafka_consumer_poll(k->rd, KAFKA_HOLD)) != NULL)
+                kafka_handle(in, &msg, 1, fn, p);
+        } else if (k->per_partition) {
+            /*
+             * The consumer queue only carries events and rebalances
+             * in this mode, it is served without blocking unless
+             * all partitions are idle.
+             */
+            n = 0;
+            for (i = 0; i < k->nqueues; i++)
+                n += kafka_consume(in, k->queues[i], 0, fn, p);
+            if ((msg = rd_kafka_consumer_poll(k->rd, n ? 0 : KAFKA_POLL)) != NULL)
+                kafka_handle(in, &msg, 1, fn, p);
+        } else if (k->batch > 1) {
+            (void)kafka_consume(in, k->queue, KAFKA_POLL, fn, p);
+        } else if ((msg = rd_kafka_consumer_poll(k->rd, KAFKA_POLL)) != NULL) {
+            kafka_handle(in, &msg, 1, fn, p);
+        }
+
+        if (uv_hrtime() - k->committed_at >= k->commit_interval * 1000000ULL)
+            kafka_commit(in, 0);
     }
+    kafka_commit(in, 1);
+    kafka_release(in);
+    kafka_queues(in, NULL);
+    rd_kafka_queue_destroy(k->queue);
     rd_kafka_unsubscribe(k->rd);
+    rd_kafka_consumer_close(k->rd);
+    rd_kafka_destroy(k->rd);
+    (void)rd_kafka_wait_destroyed(1000);
+    rd_kafka_mem_free(NULL, __atomic_exchange_n(&k->stats_json, NULL, __ATOMIC_ACQ_REL));
     log_info("kafka_start: stopped subscription");
     log_trace("kafka_start: success");
     return 0;
@@ -170,16 +757,16 @@ kafka_start(struct input *in, input_dispatch_t fn, void *p)
 int
 kafka_stop(struct input *in)
 {
-
-    struct kafka_state  *k = in->state;
-
-    in->flags &= ~INPUT_RUN;
-    rd_kafka_consumer_close(k->rd);
-    (void)rd_kafka_wait_destroyed(1000);
+    /*
+     * The consumer thread notices within KAFKA_POLL milliseconds,
+     * commits what has been processed and closes the consumer.
+     */
+    __atomic_and_fetch(&in->flags, ~INPUT_RUN, __ATOMIC_RELEASE);
     return 0;
 }
 
 struct input_impl kafka_input = {
     kafka_start,
-    kafka_stop
+    kafka_stop,
+    kafka_stats
 };
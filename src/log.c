@@ -9,9 +9,9 @@
  * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
  * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
  * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
- * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
- * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
- * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
 #define _GNU_SOURCE
@@ -23,35 +23,64 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <unistd.h>
 
-#ifndef LOG_TRACE
-#define LOG_TRACE 10
-#endif
+#include "unklog.h"
 
-#ifndef LOG_FATAL
-#define LOG_FATAL LOG_CRIT
-#endif
-
-void log_init(int, const char *);
-
-void log_trace(const char *, ...);
-void log_debug(const char *, ...);
-void log_info(const char *, ...);
-void log_warn(const char *, ...);
-void log_error(const char *, ...);
-void log_fatal(const char *, ...);
-
-void log_sys_warn(const char *, ...);
-void log_sys_error(const char *, ...);
-void log_sys_fatal(const char *, ...);
-
-void log_vprint(int, int, const char *, va_list);
-void log_print(int, int, const char *, ...);
+/*
+ * Asynchronous logging.
+ *
+ * Once log_start has been called, each thread formats its records in
+ * a ring of its own, and a writer thread drains all rings and writes
+ * their records out a batch at a time. Records which do not fit in
+ * a full ring are dropped and counted. Rings are never freed, threads
+ * are expected to live as long as the process. The writer sleeps on
+ * a condition variable while all rings are empty, and is woken by the
+ * first record pushed after that.
+ *
+ * Before that, and for errors and fatal errors, records are written
+ * right away, after what is pending in the rings. Level checks happen
+ * in the log_* macros, before any argument is evaluated.
+ */
 
-static char *log_code(int);
-static int   log_level = LOG_DEBUG;
-static FILE *stream = NULL;
+#define LOG_RING    1024
+#define LOG_LINE    512
+#define LOG_BATCH   (64 * 1024)
+
+struct log_record {
+    size_t               len;
+    char                 buf[LOG_LINE];
+};
+
+struct log_ring {
+    struct log_ring     *next;
+    uint64_t             head;
+    char                 pad[CACHELINE - sizeof(uint64_t)];
+    uint64_t             tail;
+    struct log_record    records[LOG_RING];
+};
+
+static char     *log_code(int);
+static size_t    log_format(char *, size_t, int, int, int, const char *, va_list);
+static struct log_ring *log_ring(void);
+static size_t    log_drain(char *, size_t);
+static int       log_pending(void);
+static void      log_wake(void);
+static void      log_sync(const char *, size_t);
+static void      log_write(const char *, size_t);
+static void      log_writer(void *);
+
+int                      log_level = LOG_DEBUG;
+static FILE             *stream = NULL;
+static int               log_running;
+static uv_thread_t       log_thread;
+static uv_mutex_t        log_lock;
+static uv_cond_t         log_cond;
+static int               log_idle;
+static struct log_ring  *log_rings;
+static uint64_t          log_dropped_count;
+static uint64_t          log_dropped_last;
+static __thread struct log_ring *log_local;
 
 void
 log_close()
@@ -85,6 +114,27 @@ log_init(int n_level, const char *path)
     }
 }
 
+/*
+ * Start the writer thread, after daemon(3) since threads do not
+ * survive fork.
+ */
+void
+log_start(void)
+{
+    uv_mutex_init(&log_lock);
+    if (uv_cond_init(&log_cond) != 0)
+        log_fatal("log_start: cannot create condition");
+    if (uv_thread_create(&log_thread, log_writer, NULL) != 0)
+        log_fatal("log_start: cannot start writer thread");
+    __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t
+log_dropped(void)
+{
+    return __atomic_load_n(&log_dropped_count, __ATOMIC_RELAXED);
+}
+
 char *
 log_code(int level) {
     switch (level) {
@@ -108,143 +158,231 @@ log_code(int level) {
     return "unknown";
 }
 
-void
-log_vprint(int level, int sys, const char *fmt, va_list ap)
+/*
+ * Format a whole line, truncated to fit in size bytes, newline
+ * included. Returns its length.
+ */
+size_t
+log_format(char *buf, size_t size, int level, int sys, int err,
+           const char *fmt, va_list ap)
 {
-    int      res;
-    char    *nfmt;
-    char    *code;
-
-    if (level > log_level)
-        return;
-
-    code = log_code(level);
-
+    size_t  len;
+    int     res;
+
+    res = snprintf(buf, size, "[%s] ", log_code(level));
+    len = MIN((size_t)res, size - 1);
+    res = vsnprintf(buf + len, size - len, (fmt == NULL) ? "errno" : fmt, ap);
+    if (res > 0)
+        len = MIN(len + res, size - 1);
     if (sys) {
-        res = asprintf(&nfmt, "[%s] %s: %s\n",
-                       code,
-                       (fmt == NULL) ? "errno" : fmt,
-                       strerror(errno));
-    } else {
-        res = asprintf(&nfmt, "[%s] %s\n", code, fmt);
+        res = snprintf(buf + len, size - len, ": %s", strerror(err));
+        if (res > 0)
+            len = MIN(len + res, size - 1);
     }
+    if (len == size - 1)
+        len--;
+    buf[len++] = '\n';
+    buf[len] = '\0';
+    return len;
+}
 
+struct log_ring *
+log_ring(void)
+{
+    struct log_ring *r;
+
+    if (log_local != NULL)
+        return log_local;
+    if ((r = calloc(1, sizeof(*r))) == NULL)
+        return NULL;
+    r->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&log_rings, &r->next, r, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    log_local = r;
+    return r;
+}
+
+void
+log_write(const char *buf, size_t len)
+{
     if (stream == NULL)
         stream = stderr;
-
-    if (res == -1) {
-        fprintf(stream, "[%s] ", code);
-        vfprintf(stream, fmt, ap);
-        fprintf(stream, ": %s\n", strerror(errno));
-    } else {
-        vfprintf(stream, nfmt, ap);
-        free(nfmt);
-    }
+    (void)fwrite(buf, 1, len, stream);
     fflush(stream);
 }
 
-void
-log_print(int level, int sys, const char *fmt, ...)
+/*
+ * Move records from all rings to buf, up to size bytes. Only called
+ * with log_lock held, rings have a single consumer.
+ */
+size_t
+log_drain(char *buf, size_t size)
 {
-    va_list ap;
-
-    if (level > log_level)
-        return;
-
-    va_start(ap, fmt);
-    log_vprint(level, sys, fmt, ap);
-    va_end(ap);
+    struct log_ring     *r;
+    struct log_record   *rec;
+    uint64_t             head;
+    size_t               len = 0;
+
+    for (r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        while (r->tail < head) {
+            rec = &r->records[r->tail % LOG_RING];
+            if (len + rec->len > size)
+                return len;
+            memcpy(buf + len, rec->buf, rec->len);
+            len += rec->len;
+            __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return len;
 }
 
-
-void
-log_sys_warn(const char *fmt, ...)
+/*
+ * Whether any ring holds records. Only called with log_lock held.
+ */
+int
+log_pending(void)
 {
-    va_list ap;
+    struct log_ring     *r;
 
-    va_start(ap, fmt);
-    log_vprint(LOG_WARNING, 1, fmt, ap);
-    va_end(ap);
+    for (r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail)
+            return 1;
+    }
+    return 0;
 }
 
+/*
+ * Wake the writer if it is sleeping, once a record has been pushed.
+ * The writer flags itself idle before its last look at the rings, so
+ * either it sees the record or the record's producer sees the flag.
+ */
 void
-log_sys_error(const char *fmt, ...)
+log_wake(void)
 {
-    va_list ap;
-
-    va_start(ap, fmt);
-    log_vprint(LOG_ERR, 1, fmt, ap);
-    va_end(ap);
+    if (!__atomic_load_n(&log_idle, __ATOMIC_SEQ_CST))
+        return;
+    uv_mutex_lock(&log_lock);
+    uv_cond_signal(&log_cond);
+    uv_mutex_unlock(&log_lock);
 }
 
+/*
+ * Write a record right away, after the records still in the rings so
+ * that each thread's records stay in order.
+ */
 void
-log_sys_fatal(const char *fmt, ...)
+log_sync(const char *line, size_t len)
 {
-    va_list ap;
-
-    va_start(ap, fmt);
-    log_vprint(LOG_FATAL, 1, fmt, ap);
-    va_end(ap);
-    exit(1);
+    static char  buf[LOG_BATCH];
+    size_t       n;
+
+    uv_mutex_lock(&log_lock);
+    while ((n = log_drain(buf, sizeof(buf))) > 0)
+        log_write(buf, n);
+    log_write(line, len);
+    uv_mutex_unlock(&log_lock);
 }
 
 void
-log_trace(const char *fmt, ...)
+log_writer(void *arg)
 {
-    va_list ap;
-
-    va_start(ap, fmt);
-    log_vprint(LOG_TRACE, 0, fmt, ap);
-    va_end(ap);
+    static char      buf[LOG_BATCH];
+    char             line[LOG_LINE];
+    uint64_t         dropped;
+    size_t           len;
+    size_t           n;
+
+    for (;;) {
+        uv_mutex_lock(&log_lock);
+        if ((len = log_drain(buf, sizeof(buf))) > 0)
+            log_write(buf, len);
+        dropped = log_dropped();
+        if (dropped != log_dropped_last) {
+            n = snprintf(line, sizeof(line), "[warning] log_writer: dropped %llu records\n",
+                         (unsigned long long)(dropped - log_dropped_last));
+            log_write(line, MIN(n, sizeof(line) - 1));
+            log_dropped_last = dropped;
+        }
+        if (len == 0) {
+            __atomic_store_n(&log_idle, 1, __ATOMIC_SEQ_CST);
+            if (!log_pending())
+                uv_cond_wait(&log_cond, &log_lock);
+            __atomic_store_n(&log_idle, 0, __ATOMIC_RELAXED);
+        }
+        uv_mutex_unlock(&log_lock);
+    }
 }
 
 void
-log_debug(const char *fmt, ...)
+log_vprint(int level, int sys, const char *fmt, va_list ap)
 {
-    va_list ap;
+    struct log_ring     *r;
+    struct log_record   *rec;
+    char                 line[LOG_LINE];
+    uint64_t             head;
+    int                  err = errno;
 
-    va_start(ap, fmt);
-    log_vprint(LOG_DEBUG, 0, fmt, ap);
-    va_end(ap);
-}
+    if (level > log_level)
+        return;
 
-void
-log_info(const char *fmt, ...)
-{
-    va_list ap;
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE) || (r = log_ring()) == NULL) {
+        log_write(line, log_format(line, sizeof(line), level, sys, err, fmt, ap));
+        return;
+    }
+    if (level <= LOG_ERR) {
+        log_sync(line, log_format(line, sizeof(line), level, sys, err, fmt, ap));
+        return;
+    }
 
-    va_start(ap, fmt);
-    log_vprint(LOG_INFO, 0, fmt, ap);
-    va_end(ap);
+    head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING) {
+        __atomic_add_fetch(&log_dropped_count, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rec = &r->records[head % LOG_RING];
+    rec->len = log_format(rec->buf, sizeof(rec->buf), level, sys, err, fmt, ap);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+    log_wake();
 }
 
 void
-log_warn(const char *fmt, ...)
+log_print(int level, int sys, const char *fmt, ...)
 {
     va_list ap;
 
+    if (level > log_level)
+        return;
+
     va_start(ap, fmt);
-    log_vprint(LOG_WARNING, 0, fmt, ap);
+    log_vprint(level, sys, fmt, ap);
     va_end(ap);
 }
 
+/*
+ * Write out what is left in the rings, from the calling thread.
+ */
 void
-log_error(const char *fmt, ...)
+log_flush(void)
 {
-    va_list ap;
+    static char  buf[LOG_BATCH];
+    size_t       len;
 
-    va_start(ap, fmt);
-    log_vprint(LOG_ERR, 0, fmt, ap);
-    va_end(ap);
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+        return;
+    uv_mutex_lock(&log_lock);
+    while ((len = log_drain(buf, sizeof(buf))) > 0)
+        log_write(buf, len);
+    uv_mutex_unlock(&log_lock);
 }
 
+/*
+ * Exit on a fatal error, once the fatal record has been written.
+ */
 void
-log_fatal(const char *fmt, ...)
+log_exit(void)
 {
-    va_list ap;
-
-    va_start(ap, fmt);
-    log_vprint(LOG_FATAL, 0, fmt, ap);
-    va_end(ap);
+    log_flush();
     exit(1);
 }
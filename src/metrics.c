@@ -14,201 +14,744 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+
 #define _GNU_SOURCE
+#include <sys/param.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <bsd/string.h>
 #include "unklog.h"
-#define MBUF_MAX 128
+
+#define METRIC_REQ_MAX  4096
+#define METRIC_HDR_MAX  256
+
+/*
+ * Statistics are rendered on demand, on the loop thread, into the
+ * buffer of the client asking for them. Clients are kept around once
+ * done with, along with their buffer, and reused for later requests.
+ */
+struct metric_client {
+    SLIST_ENTRY(metric_client)   entry;
+    uv_tcp_t                     handle;
+    uv_write_t                   wreq;
+    struct unklog               *uk;
+    int                          http;
+    struct metric_buf            mb;
+    char                         req[METRIC_REQ_MAX];
+    size_t                       reqlen;
+    char                         hdr[METRIC_HDR_MAX];
+};
+SLIST_HEAD(metric_client_list, metric_client);
+
+static size_t   metric_bucket(uint64_t);
+static uint64_t metric_bucket_value(size_t);
+static int      metric_shard(void);
+static void     metric_fold(struct metric_meter *);
+static void     metric_percentiles(struct metric_meter *, uint64_t *);
+static void     metric_emit_type(struct metric_buf *, const char *, const char **, uint64_t, int);
+static void     metric_sample(struct metric_buf *, size_t, int);
+static int      metric_sample_cmp(const void *, const void *);
+static void     metric_render_samples(struct metric_buf *);
+static void     metric_render_meter(struct metric_buf *, const char *, struct metric_meter *);
+static void     metric_render_histogram(struct metric_buf *, const char *, size_t);
+static void     metric_render(struct unklog *, struct metric_buf *);
+static void     metric_listen(struct unklog *, uv_tcp_t *, const char *, int, uv_connection_cb);
+static struct metric_client *metric_client_new(uv_stream_t *, int);
+static void     metric_send(struct metric_client *, int);
+static void     metric_closed(uv_handle_t *);
+static void     metric_written(uv_write_t *, int);
+static void     metric_alloc(uv_handle_t *, size_t, uv_buf_t *);
+static void     metric_read(uv_stream_t *, ssize_t, const uv_buf_t *);
+static void     metric_connect(uv_stream_t *, int);
+static void     metric_connect_http(uv_stream_t *, int);
+
+static __thread int metric_shard_id = -1;
+static int          metric_threads;
+static struct metric_client_list metric_clients = SLIST_HEAD_INITIALIZER(metric_clients);
+
+/*
+ * Upper bounds of the buckets reported in prometheus histograms, in
+ * microseconds.
+ */
+static const uint64_t metric_bounds[] = {
+    500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+    500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+#define METRIC_NBOUNDS  (sizeof(metric_bounds) / sizeof(metric_bounds[0]))
+
+int
+metric_shard(void)
+{
+    if (metric_shard_id == -1) {
+        metric_shard_id = __atomic_fetch_add(&metric_threads, 1, __ATOMIC_RELAXED);
+        if (metric_shard_id >= METRIC_SHARDS - 1)
+            metric_shard_id = METRIC_SHARDS - 1;
+    }
+    return metric_shard_id;
+}
 
 void
-metric_connect(uv_stream_t *server, int status)
+metric_inc(struct metric_counter *m)
 {
-    int              res;
-    struct unklog   *uk = server->data;
-    uv_tcp_t         client;
-    uv_write_t       wreq;
+    metric_add(m, 1);
+}
 
-    if (status == -1) {
-        log_warn("metric_connect: connection error");
-        return;
-    }
+/*
+ * A shard owned by a single thread is updated with a plain load and
+ * store, atomic only so that metric_value sees whole values.
+ */
+void
+metric_add(struct metric_counter *m, uint64_t n)
+{
+    uint64_t    *v;
+    int          id;
+
+    id = metric_shard();
+    v = &m->shards[id].value;
+    if (id < METRIC_SHARDS - 1)
+        __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(v, n, __ATOMIC_RELAXED);
+}
 
-    bzero(&client, sizeof(client));
-    uv_tcp_init(&uk->loop, &client);
+uint64_t
+metric_value(struct metric_counter *m)
+{
+    uint64_t    total = 0;
+    int         i;
 
-    res = uv_accept(server, (uv_stream_t *)&client);
-    if (res != 0) {
-        (void)uv_close((uv_handle_t *)&client, NULL);
-        return;
+    for (i = 0; i < METRIC_SHARDS; i++)
+        total += __atomic_load_n(&m->shards[i].value, __ATOMIC_RELAXED);
+    return total;
+}
+
+/*
+ * Record the time elapsed since start, as given by uv_hrtime.
+ */
+void
+metric_meter(struct metric_meter *m, uint64_t start)
+{
+    metric_meter_value(m, (uv_hrtime() - start) / 1000);
+}
+
+size_t
+metric_bucket(uint64_t value)
+{
+    int     shift;
+
+    if (value < METRIC_SUB)
+        return value;
+    if (value >= (1ULL << METRIC_BITS))
+        value = (1ULL << METRIC_BITS) - 1;
+    shift = 63 - __builtin_clzll(value) - METRIC_SUB_BITS + 1;
+    return shift * METRIC_HALF + (value >> shift);
+}
+
+/*
+ * Highest value falling in a bucket.
+ */
+uint64_t
+metric_bucket_value(size_t bucket)
+{
+    size_t  shift;
+
+    if (bucket < METRIC_SUB)
+        return bucket;
+    shift = bucket / METRIC_HALF - 1;
+    return ((bucket - shift * METRIC_HALF + 1) << shift) - 1;
+}
+
+/*
+ * Record a duration measured by the caller, in microseconds. Meters
+ * may be shared by several threads.
+ */
+void
+metric_meter_value(struct metric_meter *m, uint64_t duration)
+{
+    metric_meter_add(m, duration, 1);
+}
+
+/*
+ * Record the same duration for count events.
+ */
+void
+metric_meter_add(struct metric_meter *m, uint64_t duration, uint64_t count)
+{
+    uint64_t    max;
+
+    __atomic_add_fetch(&m->buckets[metric_bucket(duration)], count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->sum, duration * count, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&m->max, __ATOMIC_RELAXED);
+    while (duration > max &&
+           !__atomic_compare_exchange_n(&m->max, &max, duration, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Move what was recorded over the last interval out of the live
+ * buckets. Only called from the loop thread.
+ */
+void
+metric_fold(struct metric_meter *m)
+{
+    size_t  i;
+
+    for (i = 0; i < METRIC_BUCKETS; i++) {
+        m->last[i] = __atomic_exchange_n(&m->buckets[i], 0, __ATOMIC_RELAXED);
+        m->total[i] += m->last[i];
     }
-    bzero(&wreq, sizeof(wreq));
-    pthread_mutex_lock(&uk->mlock);
-    (void)uv_write(&wreq, (uv_stream_t *)&client, uk->mbufs, uk->mcount, NULL);
-    pthread_mutex_unlock(&uk->mlock);
-    (void)uv_close((uv_handle_t *)&client, NULL);
+    m->last_max = __atomic_exchange_n(&m->max, 0, __ATOMIC_RELAXED);
+    m->total_sum += __atomic_exchange_n(&m->sum, 0, __ATOMIC_RELAXED);
 }
 
+/*
+ * Count, p50, p90, p99 and p999 of the last interval.
+ */
 void
-metric_start(struct unklog *uk)
+metric_percentiles(struct metric_meter *m, uint64_t *vals)
 {
-    struct sockaddr_in sin;
-    int res;
+    static const double  pcts[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t             total = 0;
+    uint64_t             seen = 0;
+    size_t               i;
+    size_t               p = 0;
 
-    if (uk->mrun == 0) {
-        return;
+    bzero(vals, 5 * sizeof(*vals));
+    for (i = 0; i < METRIC_BUCKETS; i++)
+        total += m->last[i];
+    vals[0] = total;
+    for (i = 0; i < METRIC_BUCKETS && p < 4 && total > 0; i++) {
+        seen += m->last[i];
+        while (p < 4 && seen >= (uint64_t)(pcts[p] * total + 0.5)) {
+            vals[p + 1] = MIN(metric_bucket_value(i), m->last_max);
+            p++;
+        }
     }
-    /*
-     * The callback have been set-up, now we can set-up our listener.
-     */
-    (void)uv_ip4_addr(uk->maddr, uk->mport, &sin);
-    uv_tcp_init(&uk->loop, &uk->proxy);
-    uv_tcp_bind(&uk->proxy, (struct sockaddr *)&sin, 0);
+}
+
+/*
+ * Wall clock time in microseconds, comparable with kafka timestamps.
+ */
+uint64_t
+metric_realtime(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    uk->proxy.data = uk;
-    res = uv_listen((uv_stream_t *)&uk->proxy, 128, metric_connect);
-    if (res != 0) {
-        log_fatal("metric_start: failed to listen");
+void
+metric_counter_init(struct metric_counter *m)
+{
+    bzero(m, sizeof(*m));
+}
+
+void
+metric_meter_init(struct metric_meter *m)
+{
+    bzero(m, sizeof(*m));
+}
+
+void
+metric_printf(struct metric_buf *mb, const char *fmt, ...)
+{
+    va_list  ap;
+    size_t   size;
+    char    *buf;
+    int      len;
+
+    for (;;) {
+        va_start(ap, fmt);
+        len = vsnprintf(mb->buf + mb->len, mb->size - mb->len, fmt, ap);
+        va_end(ap);
+        if (len < 0)
+            return;
+        if (mb->len + len < mb->size)
+            break;
+        size = (mb->size == 0) ? 4096 : mb->size;
+        while (size <= mb->len + len)
+            size *= 2;
+        if ((buf = realloc(mb->buf, size)) == NULL)
+            log_sys_fatal("metric_printf: out of memory");
+        mb->buf = buf;
+        mb->size = size;
     }
+    mb->len += len;
 }
 
+void
+metric_emit(struct metric_buf *mb, const char *name, const char **labels, uint64_t value)
+{
+    metric_emit_type(mb, name, labels, value, METRIC_GAUGE);
+}
 
 void
-metric_inc(struct metric_counter *m)
+metric_emit_counter(struct metric_buf *mb, const char *name, const char **labels, uint64_t value)
 {
-    m->metric++;
+    metric_emit_type(mb, name, labels, value, METRIC_COUNTER);
 }
 
+/*
+ * Emit a value for the current input or output. Labels come as a
+ * NULL terminated list of keys and values. In the text format they
+ * become part of the name, out.es.node.0.requests for instance, in
+ * the prometheus format unklog_out_requests{out="es",node="0"}. Only
+ * the prometheus format has types.
+ */
 void
-metric_meter(struct metric_meter *m, clock_t init)
+metric_emit_type(struct metric_buf *mb, const char *name, const char **labels,
+                 uint64_t value, int type)
 {
-    uint64_t duration = (clock() - init) / (CLOCKS_PER_SEC / 1000);
+    const char  *p;
+    size_t       off;
+    size_t       i;
 
-    if (duration > m->max)
-        m->max = duration;
+    if (mb->format == METRIC_TEXT) {
+        metric_printf(mb, "%s", mb->scope);
+        if (mb->name != NULL)
+            metric_printf(mb, ".%s", mb->name);
+        for (i = 0; labels != NULL && labels[i] != NULL; i += 2)
+            metric_printf(mb, ".%s.%s", labels[i], labels[i + 1]);
+        metric_printf(mb, ".%s %lu\n", name, value);
+        return;
+    }
 
-    if (duration <= 2.0) {
-        m->slots[METRIC_2MS]++;
-    } else if (duration > 2.0 && duration <= 5.0) {
-        m->slots[METRIC_5MS]++;
-    } else if (duration > 5.0 && duration <= 10.0) {
-        m->slots[METRIC_10MS]++;
-    } else if (duration > 10.0 && duration <= 20.0) {
-        m->slots[METRIC_20MS]++;
-    } else if (duration > 20.0 && duration <= 50.0) {
-        m->slots[METRIC_50MS]++;
-    } else if (duration > 50.0 && duration <= 100.0) {
-        m->slots[METRIC_100MS]++;
-    } else if (duration > 100.0 && duration <= 200.0) {
-        m->slots[METRIC_200MS]++;
-    } else if (duration > 200.0 && duration <= 500.0) {
-        m->slots[METRIC_500MS]++;
-    } else if (duration > 500.0 && duration <= 1000.0) {
-        m->slots[METRIC_1S]++;
-    } else if (duration > 1000.0 && duration <= 2000.0) {
-        m->slots[METRIC_2S]++;
-    } else if (duration > 2000.0 && duration <= 5000.0) {
-        m->slots[METRIC_5S]++;
-    } else if (duration > 5000.0 && duration <= 10000.0) {
-        m->slots[METRIC_10S]++;
-    } else {
-        m->slots[METRIC_SLOW]++;
+    off = mb->len;
+    metric_printf(mb, "unklog_%s_", mb->scope);
+    for (p = name; *p != '\0'; p++)
+        metric_printf(mb, "%c", (*p == '.') ? '_' : *p);
+    if (mb->name == NULL && (labels == NULL || labels[0] == NULL)) {
+        metric_printf(mb, " %lu\n", value);
+        metric_sample(mb, off, type);
+        return;
+    }
+    metric_printf(mb, "{");
+    if (mb->name != NULL)
+        metric_printf(mb, "%s=\"%s\"", mb->scope, mb->name);
+    for (i = 0; labels != NULL && labels[i] != NULL; i += 2) {
+        metric_printf(mb, "%s%s=\"", (i > 0 || mb->name != NULL) ? "," : "", labels[i]);
+        for (p = labels[i + 1]; *p != '\0'; p++) {
+            if (*p == '"' || *p == '\\')
+                metric_printf(mb, "\\");
+            metric_printf(mb, "%c", *p);
+        }
+        metric_printf(mb, "\"");
     }
+    metric_printf(mb, "} %lu\n", value);
+    metric_sample(mb, off, type);
 }
 
+/*
+ * Record the prometheus sample starting at off, under the family of
+ * the same name, which is looked up among those seen so far.
+ */
 void
-metric_counter_init(struct metric_counter *m)
+metric_sample(struct metric_buf *mb, size_t off, int type)
 {
-    m->metric = 0;
+    struct metric_family    *fam;
+    struct metric_sample    *sample;
+    const char              *line = mb->buf + off;
+    size_t                   nlen;
+    size_t                   size;
+    size_t                   f;
+
+    nlen = strcspn(line, "{ ");
+    for (f = 0; f < mb->nfamilies; f++) {
+        fam = &mb->families[f];
+        if (fam->len == nlen && memcmp(mb->buf + fam->off, line, nlen) == 0)
+            break;
+    }
+    if (f == mb->nfamilies) {
+        if (mb->nfamilies == mb->families_size) {
+            size = (mb->families_size == 0) ? 64 : mb->families_size * 2;
+            if ((fam = realloc(mb->families, size * sizeof(*fam))) == NULL)
+                log_sys_fatal("metric_sample: out of memory");
+            mb->families = fam;
+            mb->families_size = size;
+        }
+        fam = &mb->families[mb->nfamilies++];
+        fam->off = off;
+        fam->len = nlen;
+        fam->type = type;
+    }
+
+    if (mb->nsamples == mb->samples_size) {
+        size = (mb->samples_size == 0) ? 256 : mb->samples_size * 2;
+        if ((sample = realloc(mb->samples, size * sizeof(*sample))) == NULL)
+            log_sys_fatal("metric_sample: out of memory");
+        mb->samples = sample;
+        mb->samples_size = size;
+    }
+    sample = &mb->samples[mb->nsamples++];
+    sample->family = f;
+    sample->off = off;
+    sample->len = mb->len - off;
 }
 
+int
+metric_sample_cmp(const void *a, const void *b)
+{
+    const struct metric_sample  *sa = a;
+    const struct metric_sample  *sb = b;
+
+    if (sa->family != sb->family)
+        return (sa->family < sb->family) ? -1 : 1;
+    return (sa->off < sb->off) ? -1 : (sa->off > sb->off);
+}
+
+/*
+ * Write samples out family by family, in order of first appearance,
+ * each family preceded by its type. The buffer samples were rendered
+ * into is kept as a spare for the next time.
+ */
 void
-metric_meter_init(struct metric_meter *m)
+metric_render_samples(struct metric_buf *mb)
 {
-    int i;
-    m->max = 0;
-    for (i = 0; i < METRIC_SLOTMAX; i++) {
-        m->slots[i] = 0;
+    struct metric_sample    *sample;
+    struct metric_family    *fam;
+    char                    *lines;
+    size_t                   size;
+    size_t                   i;
+
+    qsort(mb->samples, mb->nsamples, sizeof(*mb->samples), metric_sample_cmp);
+    lines = mb->buf;
+    size = mb->size;
+    mb->buf = mb->spare;
+    mb->size = mb->spare_size;
+    mb->len = 0;
+    mb->spare = lines;
+    mb->spare_size = size;
+    for (i = 0; i < mb->nsamples; i++) {
+        sample = &mb->samples[i];
+        if (i == 0 || sample->family != mb->samples[i - 1].family) {
+            fam = &mb->families[sample->family];
+            metric_printf(mb, "# TYPE %.*s %s\n", (int)fam->len, lines + fam->off,
+                          (fam->type == METRIC_COUNTER) ? "counter" : "gauge");
+        }
+        metric_printf(mb, "%.*s", (int)sample->len, lines + sample->off);
     }
 }
 
+/*
+ * Percentiles of the last interval in the text format, in
+ * milliseconds. Prometheus histograms are rendered separately.
+ */
 void
-metric_format(struct unklog *uk, uv_buf_t *buf, struct metric_counter *m)
+metric_render_meter(struct metric_buf *mb, const char *name, struct metric_meter *m)
 {
-    char    *s;
+    uint64_t    vals[5];
 
-    asprintf(&s, "global.uptime %ld\nglobal.count %ld\n",
-             uk->uptime, m->metric);
-    buf->base = s;
-    buf->len = strlen(s);
+    metric_percentiles(m, vals);
+    metric_printf(mb,
+                  "%s.%s.%s.count %lu\n"
+                  "%s.%s.%s.p50 %.3f\n%s.%s.%s.p90 %.3f\n"
+                  "%s.%s.%s.p99 %.3f\n%s.%s.%s.p999 %.3f\n"
+                  "%s.%s.%s.max %.3f\n",
+                  mb->scope, mb->name, name, vals[0],
+                  mb->scope, mb->name, name, vals[1] / 1000.0,
+                  mb->scope, mb->name, name, vals[2] / 1000.0,
+                  mb->scope, mb->name, name, vals[3] / 1000.0,
+                  mb->scope, mb->name, name, vals[4] / 1000.0,
+                  mb->scope, mb->name, name, m->last_max / 1000.0);
 }
 
+/*
+ * Cumulative histograms in seconds, one family per meter for all
+ * outputs, as prometheus expects families to be contiguous.
+ */
 void
-metric_format_in(uv_buf_t *buf, char *pfx, struct metric_counter *m)
+metric_render_histogram(struct metric_buf *mb, const char *name, size_t off)
 {
-    char    *s;
+    struct unklog       *uk = mb->uk;
+    struct output       *out;
+    struct metric_meter *m;
+    uint64_t             count;
+    size_t               i;
+    size_t               b;
 
-    asprintf(&s, "in.%s.count %ld\n", pfx, m->metric);
-    buf->base = s;
-    buf->len = strlen(s);
+    metric_printf(mb, "# TYPE unklog_out_%s_seconds histogram\n", name);
+    TAILQ_FOREACH(out, &uk->outputs, entry) {
+        m = (struct metric_meter *)((char *)out + off);
+        count = 0;
+        i = 0;
+        for (b = 0; b < METRIC_NBOUNDS; b++) {
+            for (; i < METRIC_BUCKETS && metric_bucket_value(i) <= metric_bounds[b]; i++)
+                count += m->total[i];
+            metric_printf(mb, "unklog_out_%s_seconds_bucket{out=\"%s\",le=\"%g\"} %lu\n",
+                          name, out->name, metric_bounds[b] / 1000000.0, count);
+        }
+        for (; i < METRIC_BUCKETS; i++)
+            count += m->total[i];
+        metric_printf(mb, "unklog_out_%s_seconds_bucket{out=\"%s\",le=\"+Inf\"} %lu\n",
+                      name, out->name, count);
+        metric_printf(mb, "unklog_out_%s_seconds_sum{out=\"%s\"} %.6f\n",
+                      name, out->name, m->total_sum / 1000000.0);
+        metric_printf(mb, "unklog_out_%s_seconds_count{out=\"%s\"} %lu\n",
+                      name, out->name, count);
+    }
 }
 
 void
-metric_format_out(struct unklog *uk, uv_buf_t *buf, char *pfx,
-                  struct metric_counter *m, struct metric_counter *err,
-                  struct metric_meter *mtr)
+metric_render(struct unklog *uk, struct metric_buf *mb)
 {
-    int      i;
-    char     meters[512];
-    char     numbuf[16];
-    char    *s;
-    uint64_t    lag;
+    struct input    *in;
+    struct output   *out;
+    uint64_t         count;
+    uint64_t         dropped;
+    uint64_t         total;
+
+    mb->len = 0;
+    mb->nsamples = 0;
+    mb->nfamilies = 0;
+    mb->uk = uk;
+    mb->scope = "global";
+    mb->name = NULL;
+    total = metric_value(&uk->count);
+    metric_emit(mb, "uptime", NULL, uk->uptime);
+    metric_emit_counter(mb, "count", NULL, total);
+    metric_emit(mb, "memory", NULL, payload_memory());
+    metric_emit_counter(mb, "dropped", NULL, metric_value(&uk->dropped));
+    arena_stats(mb);
+    metric_emit_counter(mb, "log.dropped", NULL, log_dropped());
+
+    mb->scope = "in";
+    TAILQ_FOREACH(in, &uk->inputs, entry) {
+        mb->name = in->name;
+        metric_emit_counter(mb, "count", NULL, metric_value(&in->count));
+        if (in->impl->stats != NULL)
+            in->impl->stats(in, mb);
+    }
+
+    mb->scope = "out";
+    TAILQ_FOREACH(out, &uk->outputs, entry) {
+        mb->name = out->name;
+        count = metric_value(&out->count);
+        dropped = metric_value(&out->dropped);
+        metric_emit_counter(mb, "count", NULL, count);
+        metric_emit_counter(mb, "errs", NULL, metric_value(&out->errors));
+
+        /*
+         * Counters are read one after the other while threads keep
+         * updating them, the output may look ahead of the total.
+         */
+        metric_emit(mb, "lag", NULL,
+                    (count + dropped < total) ? total - count - dropped : 0);
+        metric_emit(mb, "queue.items", NULL, __atomic_load_n(&out->items, __ATOMIC_RELAXED));
+        metric_emit(mb, "queue.bytes", NULL, __atomic_load_n(&out->bytes, __ATOMIC_RELAXED));
+        metric_emit_counter(mb, "dropped", NULL, dropped);
+        if (mb->format == METRIC_TEXT) {
+            metric_render_meter(mb, "meter", &out->meter);
+            metric_render_meter(mb, "delay", &out->delay);
+            metric_render_meter(mb, "queue", &out->queue);
+            metric_render_meter(mb, "sink", &out->sink);
+        }
+
+        /*
+         * Spill rates are in bytes per second over the last interval.
+         */
+        if (out->spill != NULL) {
+            metric_emit(mb, "spill.bytes", NULL, spill_bytes(out->spill));
+            metric_emit(mb, "spill.rate", NULL, out->spill_rate);
+            metric_emit(mb, "replay.rate", NULL, out->replay_rate);
+        }
+        if (out->impl->stats != NULL)
+            out->impl->stats(out, mb);
+    }
 
-    bzero(meters, sizeof(meters));
-    for (i = 0; i < METRIC_SLOTMAX; i++) {
-        bzero(numbuf, sizeof(numbuf));
-        snprintf(numbuf, sizeof(numbuf), " %d", mtr->slots[i]);
-        (void)strlcat(meters, numbuf, sizeof(meters));
+    if (mb->format == METRIC_PROM) {
+        metric_render_samples(mb);
+        metric_render_histogram(mb, "meter", offsetof(struct output, meter));
+        metric_render_histogram(mb, "delay", offsetof(struct output, delay));
+        metric_render_histogram(mb, "queue", offsetof(struct output, queue));
+        metric_render_histogram(mb, "sink", offsetof(struct output, sink));
     }
-    lag = uk->count.metric - m->metric;
-    bzero(numbuf, sizeof(numbuf));
-    snprintf(numbuf, sizeof(numbuf), " max:%ld", mtr->max);
-    (void)strlcat(meters, numbuf, sizeof(meters));
-    asprintf(&s, "out.%s.count %ld\nout.%s.errs %ld\nout.%s.lag %ld\nout.%s.meter%s\n",
-             pfx,  m->metric, pfx, err->metric, pfx, lag, pfx, meters);
-    buf->base = s;
-    buf->len = strlen(s);
 }
 
+/*
+ * Called every METRIC_INTERVAL, closes the current interval.
+ */
 void
 metric_flush(uv_timer_t *t)
 {
-    int              i;
     struct unklog   *uk = t->data;
-    struct input    *in;
     struct output   *out;
+    uint64_t         spilled;
+    uint64_t         replayed;
 
-    uv_mutex_lock(&uk->mlock);
-    if (uk->mbufs != NULL) {
-        for (i = 0; i < uk->mcount; i++)
-            free(uk->mbufs[i].base);
-        free(uk->mbufs);
-        uk->mbufs = NULL;
-        uk->mcount = 0;
+    TAILQ_FOREACH(out, &uk->outputs, entry) {
+        metric_fold(&out->meter);
+        metric_fold(&out->delay);
+        metric_fold(&out->queue);
+        metric_fold(&out->sink);
+        if (out->spill != NULL) {
+            spilled = metric_value(&out->spilled);
+            replayed = metric_value(&out->replayed);
+            out->spill_rate = (spilled - out->spilled_last) * 1000 / METRIC_INTERVAL;
+            out->replay_rate = (replayed - out->replayed_last) * 1000 / METRIC_INTERVAL;
+            out->spilled_last = spilled;
+            out->replayed_last = replayed;
+        }
     }
-    uk->mcount = 1 + uk->incount + uk->outcount;
-    if ((uk->mbufs = calloc(uk->mcount, sizeof(*uk->mbufs))) == NULL)
-        log_sys_fatal("metric_flush: out of memory");
+}
 
-    metric_format(uk, &uk->mbufs[0], &uk->count);
+struct metric_client *
+metric_client_new(uv_stream_t *server, int http)
+{
+    struct unklog           *uk = server->data;
+    struct metric_client    *c;
 
-    i = 1;
-    TAILQ_FOREACH(in, &uk->inputs, entry) {
-        metric_format_in(&uk->mbufs[i++], in->name, &in->count);
+    if ((c = SLIST_FIRST(&metric_clients)) != NULL) {
+        SLIST_REMOVE_HEAD(&metric_clients, entry);
+    } else if ((c = calloc(1, sizeof(*c))) == NULL) {
+        log_sys_error("metric_client_new: out of memory");
+        return NULL;
+    }
+    c->uk = uk;
+    c->http = http;
+    c->reqlen = 0;
+    c->mb.len = 0;
+    c->mb.format = http ? METRIC_PROM : METRIC_TEXT;
+    uv_tcp_init(&uk->loop, &c->handle);
+    c->handle.data = c;
+    if (uv_accept(server, (uv_stream_t *)&c->handle) != 0) {
+        uv_close((uv_handle_t *)&c->handle, metric_closed);
+        return NULL;
     }
+    return c;
+}
 
-    TAILQ_FOREACH(out, &uk->outputs, entry) {
-        metric_format_out(uk, &uk->mbufs[i++], out->name, &out->count, &out->errors, &out->meter);
+void
+metric_closed(uv_handle_t *handle)
+{
+    struct metric_client    *c = handle->data;
+
+    SLIST_INSERT_HEAD(&metric_clients, c, entry);
+}
+
+void
+metric_written(uv_write_t *req, int status)
+{
+    struct metric_client    *c = req->data;
+
+    uv_close((uv_handle_t *)&c->handle, metric_closed);
+}
+
+void
+metric_send(struct metric_client *c, int status)
+{
+    uv_buf_t     bufs[2];
+    int          n = 0;
+
+    if (status == 200)
+        metric_render(c->uk, &c->mb);
+    else
+        c->mb.len = 0;
+    if (c->http) {
+        snprintf(c->hdr, sizeof(c->hdr),
+                 "HTTP/1.1 %d %s\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n",
+                 status, (status == 200) ? "OK" : "Not Found", c->mb.len);
+        bufs[n++] = uv_buf_init(c->hdr, strlen(c->hdr));
     }
-    uv_mutex_unlock(&uk->mlock);
+    if (c->mb.len > 0)
+        bufs[n++] = uv_buf_init(c->mb.buf, c->mb.len);
+    c->wreq.data = c;
+    if (uv_write(&c->wreq, (uv_stream_t *)&c->handle, bufs, n, metric_written) != 0)
+        uv_close((uv_handle_t *)&c->handle, metric_closed);
+}
+
+void
+metric_alloc(uv_handle_t *handle, size_t hint, uv_buf_t *buf)
+{
+    struct metric_client    *c = handle->data;
+
+    *buf = uv_buf_init(c->req + c->reqlen, sizeof(c->req) - c->reqlen - 1);
+}
+
+/*
+ * Only the request line matters, the rest of the request is read
+ * and ignored.
+ */
+void
+metric_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+    struct metric_client    *c = stream->data;
+
+    if (nread == 0)
+        return;
+    if (nread < 0) {
+        uv_close((uv_handle_t *)&c->handle, metric_closed);
+        return;
+    }
+    c->reqlen += nread;
+    c->req[c->reqlen] = '\0';
+    if (strstr(c->req, "\r\n\r\n") == NULL && strstr(c->req, "\n\n") == NULL) {
+        if (c->reqlen + 1 < sizeof(c->req))
+            return;
+    }
+    uv_read_stop(stream);
+    if (strncmp(c->req, "GET /metrics ", 13) == 0 ||
+        strncmp(c->req, "GET / ", 6) == 0)
+        metric_send(c, 200);
+    else
+        metric_send(c, 404);
+}
+
+void
+metric_connect(uv_stream_t *server, int status)
+{
+    struct metric_client    *c;
+
+    if (status < 0) {
+        log_warn("metric_connect: connection error");
+        return;
+    }
+    if ((c = metric_client_new(server, 0)) != NULL)
+        metric_send(c, 200);
+}
+
+void
+metric_connect_http(uv_stream_t *server, int status)
+{
+    struct metric_client    *c;
+
+    if (status < 0) {
+        log_warn("metric_connect_http: connection error");
+        return;
+    }
+    if ((c = metric_client_new(server, 1)) == NULL)
+        return;
+    if (uv_read_start((uv_stream_t *)&c->handle, metric_alloc, metric_read) != 0)
+        uv_close((uv_handle_t *)&c->handle, metric_closed);
+}
+
+void
+metric_listen(struct unklog *uk, uv_tcp_t *server, const char *addr, int port,
+              uv_connection_cb cb)
+{
+    struct sockaddr_in sin;
+
+    if (uv_ip4_addr(addr, port, &sin) != 0)
+        log_fatal("metric_listen: invalid address: %s", addr);
+    uv_tcp_init(&uk->loop, server);
+    if (uv_tcp_bind(server, (struct sockaddr *)&sin, 0) != 0)
+        log_fatal("metric_listen: cannot bind to %s:%d", addr, port);
+    server->data = uk;
+    if (uv_listen((uv_stream_t *)server, 128, cb) != 0)
+        log_fatal("metric_listen: failed to listen on %s:%d", addr, port);
+}
+
+void
+metric_start(struct unklog *uk)
+{
+    if (uk->mrun)
+        metric_listen(uk, &uk->proxy, uk->maddr, uk->mport, metric_connect);
+    if (uk->prun)
+        metric_listen(uk, &uk->prom, uk->paddr, uk->pport, metric_connect_http);
 }
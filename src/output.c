@@ -14,65 +14,383 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/param.h>
 #include <stdlib.h>
+#include <time.h>
 #include "unklog.h"
 
-static void output_dispose(struct payload *);
 static void output_pop(void *);
+static int  output_backoff(struct worker *, uint64_t *);
+static int  output_process(struct worker *, struct payload *);
+static void output_drained(struct output *, struct payload *);
+static void output_shed(struct worker *);
+static void output_latency(struct output *, struct payload **, size_t, uint64_t);
+static int  output_spill(struct output *, struct payload *);
+static struct worker *output_route(struct output *, struct payload *);
 static void output_create(struct unklog *, struct output *);
 
-void
-output_dispose(struct payload *p)
-{
-    free(p->buf);
-    free(p->type);
-    free(p);
-}
-
 void
 output_pop(void *p)
 {
-    struct output   *out = p;
-    struct payload  *payload;
-    clock_t          start;
+    struct worker   *w = p;
+    struct output   *out = w->out;
+    struct payload **batch;
+    size_t           count;
+    size_t           errors;
+    size_t           done;
+    size_t           bytes;
+    size_t           i;
+    int              replay;
+    uint64_t         start;
+    uint64_t         backoff;
 
     log_trace("output_pop: enter");
-    log_info("output_pop: starting worker thread for output %s", out->name);
+    log_info("output_pop: starting worker thread %zu for output %s", w->id, out->name);
+
+    if ((batch = calloc(out->batch, sizeof(*batch))) == NULL)
+        log_sys_fatal("output_pop: out of memory");
 
-    while (out->flags & OUTPUT_RUN) {
-        start = clock();
-        uv_mutex_lock(&out->lock);
-        while (STAILQ_EMPTY(&out->payloads) && (out->flags & OUTPUT_RUN)) {
-            uv_cond_wait(&out->signal, &out->lock);
+    while (__atomic_load_n(&out->flags, __ATOMIC_ACQUIRE) & OUTPUT_RUN) {
+        if (output_overcommitted(out->uk))
+            output_shed(w);
+        start = uv_hrtime();
+        for (count = 0; count < out->batch; count++) {
+            if ((batch[count] = ring_pop(&w->ring)) == NULL)
+                break;
+            output_drained(out, batch[count]);
         }
-        if (!(out->flags & OUTPUT_RUN)) {
-            log_info("output_pop: signaled to stop, quitting");
-            return;
+
+        /*
+         * Spilled payloads are replayed once the queue is empty. In
+         * ordered mode only the first worker replays so that
+         * payloads from a partition are not processed concurrently.
+         */
+        replay = 0;
+        if (count == 0 && out->spill != NULL &&
+            (w->id == 0 || !(out->flags & OUTPUT_ORDERED))) {
+            if ((count = spill_pop(out->spill, batch, out->batch, &bytes)) > 0) {
+                metric_add(&out->replayed, bytes);
+                replay = 1;
+            }
+        }
+        if (count == 0) {
+            /*
+             * Outputs which buffer payloads need to be woken up
+             * regularly to honor their flush deadlines, spilling
+             * outputs to look for payloads to replay.
+             */
+            if (out->impl->flush == NULL && out->spill == NULL) {
+                (void)ring_wait(&w->ring, -1);
+            } else if (ring_wait(&w->ring, OUTPUT_TICK) == 0) {
+                if (out->impl->flush != NULL)
+                    (void)out->impl->flush(w);
+                if (out->spill != NULL) {
+                    spill_sync(out->spill);
+                    spill_collect(out->spill);
+                }
+            }
+            continue;
+        }
+        metric_add(&out->count, count);
+        output_latency(out, batch, count, start);
+
+        if (out->impl->payload_batch != NULL) {
+            /*
+             * Payloads which could not be processed are handed over
+             * again until they are, only then are they released.
+             */
+            backoff = 0;
+            done = 0;
+            while ((errors = out->impl->payload_batch(w, batch + done, count - done)) > 0) {
+                done = count - errors;
+                metric_add(&out->errors, errors);
+                log_warn("output_pop: could not process %zu payloads, retrying", errors);
+                if (output_backoff(w, &backoff) != 0)
+                    break;
+            }
+            if (errors == 0)
+                done = count;
+            for (i = 0; i < done; i++)
+                payload_release(batch[i]);
+            if (done < count)
+                log_warn("output_pop: leaving %zu payloads unprocessed", count - done);
+            if (!(out->flags & OUTPUT_BULK)) {
+                metric_meter(&out->meter, start);
+                metric_meter_add(&out->sink, (uv_hrtime() - start) / 1000, done);
+            }
+            if (replay)
+                spill_collect(out->spill);
+            continue;
         }
-        payload = STAILQ_FIRST(&out->payloads);
-        STAILQ_REMOVE_HEAD(&out->payloads, entry);
-        uv_mutex_unlock(&out->lock);
-        metric_inc(&out->count);
-        if (out->impl->payload(out, payload->type, payload->buf, payload->len) != 0) {
-            metric_inc(&out->errors);
-            log_warn("output_pop: could not process payload");
+
+        /*
+         * Each payload is timed on its own, time spent waiting for
+         * the previous ones of the batch is not sink time.
+         */
+        for (i = 0; i < count; i++) {
+            start = uv_hrtime();
+            if (output_process(w, batch[i]) != 0) {
+                log_warn("output_pop: leaving %zu payloads unprocessed", count - i);
+                break;
+            }
+            payload_release(batch[i]);
+            if (!(out->flags & OUTPUT_BULK)) {
+                metric_meter(&out->meter, start);
+                metric_meter(&out->sink, start);
+            }
         }
-        output_dispose(payload);
-        metric_meter(&out->meter, start);
+        if (replay)
+            spill_collect(out->spill);
     }
+    free(batch);
+    log_info("output_pop: signaled to stop, quitting");
     log_trace("output_pop: leaving");
 }
 
+/*
+ * Wait before handing payloads over again, twice as long each time.
+ * The queue fills up in the meantime, which holds the inputs back or
+ * makes them spill. Returns -1 once the output is stopping, payloads
+ * which were not processed are then left held so that their offsets
+ * are not committed.
+ */
+int
+output_backoff(struct worker *w, uint64_t *backoff)
+{
+    struct timespec  ts = { 0, OUTPUT_TICK * 1000000 };
+    uint64_t         waited;
+
+    *backoff = (*backoff == 0) ? OUTPUT_BACKOFF_MIN :
+        MIN(*backoff * 2, OUTPUT_BACKOFF_MAX);
+    for (waited = 0; waited < *backoff; waited += OUTPUT_TICK) {
+        if (!(__atomic_load_n(&w->out->flags, __ATOMIC_ACQUIRE) & OUTPUT_RUN))
+            return -1;
+        (void)nanosleep(&ts, NULL);
+    }
+    return (__atomic_load_n(&w->out->flags, __ATOMIC_ACQUIRE) & OUTPUT_RUN) ? 0 : -1;
+}
+
+int
+output_process(struct worker *w, struct payload *p)
+{
+    struct output   *out = w->out;
+    uint64_t         backoff = 0;
+
+    while (out->impl->payload(w, p->type, p->buf, p->len) != 0) {
+        metric_inc(&out->errors);
+        log_warn("output_process: could not process payload, retrying");
+        if (output_backoff(w, &backoff) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Time spent between kafka and the input, and in the queue. Payloads
+ * replayed from a spill have no queue time, it would span restarts.
+ */
+void
+output_latency(struct output *out, struct payload **batch, size_t count, uint64_t now)
+{
+    struct payload  *p;
+    size_t           i;
+
+    for (i = 0; i < count; i++) {
+        p = batch[i];
+        if (p->timestamp >= 0 && p->received >= (uint64_t)p->timestamp * 1000)
+            metric_meter_value(&out->delay, p->received - p->timestamp * 1000);
+        if (p->enqueued != 0 && now > p->enqueued)
+            metric_meter_value(&out->queue, (now - p->enqueued) / 1000);
+    }
+}
+
+/*
+ * With the drop-oldest memory policy, workers drop payloads from the
+ * head of their queue until the process is back under its limit.
+ */
+void
+output_shed(struct worker *w)
+{
+    struct output   *out = w->out;
+    struct payload  *payload;
+    size_t           count = 0;
+
+    while (output_overcommitted(out->uk) &&
+           (payload = ring_pop(&w->ring)) != NULL) {
+        output_drained(out, payload);
+        payload_release(payload);
+        count++;
+    }
+    if (count > 0) {
+        metric_add(&out->dropped, count);
+        log_debug("output_shed: dropped %zu payloads from output %s", count, out->name);
+    }
+}
+
+/*
+ * Inputs are resumed once the queue has drained down to half of
+ * its limits.
+ */
+void
+output_drained(struct output *out, struct payload *payload)
+{
+    size_t  items;
+    size_t  bytes;
+
+    items = __atomic_sub_fetch(&out->items, 1, __ATOMIC_RELAXED);
+    bytes = __atomic_sub_fetch(&out->bytes, payload->len, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&out->full, __ATOMIC_RELAXED) &&
+        (out->max_items == 0 || items <= out->max_items / 2) &&
+        (out->max_bytes == 0 || bytes <= out->max_bytes / 2) &&
+        __atomic_exchange_n(&out->full, 0, __ATOMIC_ACQ_REL)) {
+        __atomic_sub_fetch(&out->uk->congested, 1, __ATOMIC_RELEASE);
+        log_debug("output_drained: output %s drained", out->name);
+    }
+}
+
+/*
+ * In ordered mode all payloads from a partition go to the same
+ * worker. Otherwise the worker with the shortest queue is picked.
+ */
+struct worker *
+output_route(struct output *out, struct payload *payload)
+{
+    struct worker   *w;
+    size_t           i;
+    size_t           len;
+    size_t           min;
+
+    if (out->nworkers == 1)
+        return &out->workers[0];
+    if ((out->flags & OUTPUT_ORDERED) && payload->partition >= 0)
+        return &out->workers[payload->partition % out->nworkers];
+
+    w = &out->workers[0];
+    min = ring_size(&w->ring);
+    for (i = 1; i < out->nworkers && min > 0; i++) {
+        if ((len = ring_size(&out->workers[i].ring)) < min) {
+            w = &out->workers[i];
+            min = len;
+        }
+    }
+    return w;
+}
+
+/*
+ * Once an output with a spill directory goes over its limits,
+ * payloads are written to disk instead of congesting the inputs,
+ * until the worker has replayed all of them. A spilled payload is
+ * released once its record has been synced.
+ *
+ * Returns 0 when the payload went to disk, 1 when it should have but
+ * the spill refused it, -1 otherwise.
+ */
+int
+output_spill(struct output *out, struct payload *payload)
+{
+    int          over;
+
+    over = (out->max_items > 0 &&
+            __atomic_load_n(&out->items, __ATOMIC_RELAXED) >= out->max_items) ||
+           (out->max_bytes > 0 &&
+            __atomic_load_n(&out->bytes, __ATOMIC_RELAXED) + payload->len >= out->max_bytes);
+    if (spill_push(out->spill, payload, over) != 0)
+        return over ? 1 : -1;
+    metric_add(&out->spilled, payload->len);
+    ring_notify(&out->workers[0].ring);
+    return 0;
+}
+
+void
+output_push(struct output *out, struct payload *payload)
+{
+    size_t  items;
+    size_t  bytes;
+    int     spilled = -1;
+
+    if (out->spill != NULL && (spilled = output_spill(out, payload)) == 0)
+        return;
+    items = __atomic_add_fetch(&out->items, 1, __ATOMIC_RELAXED);
+    bytes = __atomic_add_fetch(&out->bytes, payload->len, __ATOMIC_RELAXED);
+
+    /*
+     * Outputs with a spill directory hold the inputs back only when
+     * the spill refuses payloads, for instance on a full disk.
+     */
+    if ((out->spill == NULL || spilled == 1) &&
+        ((out->max_items > 0 && items >= out->max_items) ||
+         (out->max_bytes > 0 && bytes >= out->max_bytes)) &&
+        !__atomic_exchange_n(&out->full, 1, __ATOMIC_ACQ_REL)) {
+        __atomic_add_fetch(&out->uk->congested, 1, __ATOMIC_RELEASE);
+        log_debug("output_push: output %s is full", out->name);
+    }
+
+    /*
+     * A payload which cannot be queued while stopping is left held,
+     * its offset will not be committed.
+     */
+    if (ring_put(&output_route(out, payload)->ring, payload, &out->uk->stopping) != 0) {
+        output_drained(out, payload);
+        log_debug("output_push: output %s is stopping, payload not queued", out->name);
+    }
+}
+
+/*
+ * Inputs held back by the memory limit are resumed once payloads
+ * are down to half of it.
+ */
+int
+output_congested(struct unklog *uk)
+{
+    if (__atomic_load_n(&uk->memory_full, __ATOMIC_RELAXED) &&
+        payload_memory() <= uk->memory_limit / 2 &&
+        __atomic_exchange_n(&uk->memory_full, 0, __ATOMIC_ACQ_REL)) {
+        __atomic_sub_fetch(&uk->congested, 1, __ATOMIC_RELEASE);
+        log_debug("output_congested: back under memory limit");
+    }
+    return __atomic_load_n(&uk->congested, __ATOMIC_ACQUIRE) > 0;
+}
+
+int
+output_overcommitted(struct unklog *uk)
+{
+    return uk->memory_policy == MEMORY_DROP_OLDEST && uk->memory_limit > 0 &&
+           payload_memory() > uk->memory_limit;
+}
+
 void
 output_create(struct unklog *uk, struct output *out)
 {
+    struct worker   *w;
+    size_t           i;
+    size_t           size;
+
     log_trace("output_create: enter");
-    uv_mutex_init(&out->lock);
-    STAILQ_INIT(&out->payloads);
-    out->impl->start(out);
+    out->uk = uk;
+    if (out->batch == 0)
+        out->batch = OUTPUT_BATCH;
+    if (out->nworkers == 0)
+        out->nworkers = 1;
+    if ((out->workers = calloc(out->nworkers, sizeof(*out->workers))) == NULL)
+        log_sys_fatal("output_create: out of memory");
+
+    if (out->spill_dir[0] != '\0')
+        out->spill = spill_open(out->spill_dir, out->spill_segment);
+
+    size = (out->max_items > 0) ? 2 * out->max_items : RING_SIZE;
     out->flags |= OUTPUT_RUN;
-    if (uv_thread_create(&out->thread, output_pop, out) != 0)
-        log_fatal("output_create: could not start worker for output %s", out->name);
+    for (i = 0; i < out->nworkers; i++) {
+        w = &out->workers[i];
+        w->out = out;
+        w->id = i;
+        ring_init(&w->ring, size);
+        out->impl->start(w);
+    }
+    for (i = 0; i < out->nworkers; i++) {
+        w = &out->workers[i];
+        if (uv_thread_create(&w->thread, output_pop, w) != 0)
+            log_fatal("output_create: could not start worker for output %s", out->name);
+    }
     log_trace("output_create: leave");
 }
 
@@ -80,13 +398,17 @@ void
 output_stop(struct unklog *uk)
 {
     struct output   *out;
+    size_t           i;
 
     log_trace("output_stop: enter");
     TAILQ_FOREACH(out, &uk->outputs, entry) {
-        uv_mutex_lock(&out->lock);
-        out->impl->stop(out);
-        uv_cond_signal(&out->signal);
-        uv_mutex_unlock(&out->lock);
+        __atomic_and_fetch(&out->flags, ~OUTPUT_RUN, __ATOMIC_RELEASE);
+        for (i = 0; i < out->nworkers; i++)
+            ring_wake(&out->workers[i].ring);
+        for (i = 0; i < out->nworkers; i++) {
+            (void)uv_thread_join(&out->workers[i].thread);
+            out->impl->stop(&out->workers[i]);
+        }
     }
     log_trace("output_stop: leave");
 }
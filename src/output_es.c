@@ -14,26 +14,185 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+#include <sys/param.h>
+#include <poll.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
 #include <bsd/string.h>
 #include <curl/curl.h>
+#include <zlib.h>
 #include "unklog.h"
 
+struct es_state;
+struct es_request;
+struct es_node;
+struct es_cluster;
+
 static void es_curl_error(const char *, const char *, CURLcode, const char *, int);
 static size_t   es_write(void *, size_t, size_t, void *);
-static int  es_start(struct output *);
-static int  es_stop(struct output *);
-static int  es_payload(struct output *, const char *, const char *, size_t);
+static int  es_start(struct worker *);
+static int  es_stop(struct worker *);
+static int  es_flush(struct worker *);
+static size_t   es_batch(struct worker *, struct payload **, size_t);
+static int64_t es_index_key(struct es_state *, time_t);
+static const char *es_index_name(struct es_state *, int64_t);
+static int64_t es_index_of(struct es_state *, struct payload *, int64_t);
+static int  es_timestamp(const char *, size_t, time_t *);
+static void es_stats(struct output *, struct metric_buf *);
+static void es_node_add(struct es_cluster *, const char *);
+static struct es_node *es_node_pick(struct es_cluster *, const char *);
+static void es_node_done(struct es_cluster *, struct es_node *, int, uint64_t);
+static void es_node_release(struct es_cluster *, struct es_node *);
+static void es_request_init(struct es_state *, struct es_request *);
+static struct es_request *es_acquire(struct worker *);
+static int  es_submit(struct worker *, struct es_request *, const char *, size_t);
+static void es_complete(struct worker *, struct es_request *, CURLcode);
+static void es_finish(struct worker *, struct es_request *, int);
+static void es_defer(struct worker *, struct es_request *);
+static void es_retry(struct worker *);
+static void es_progress(struct worker *, int);
+static void es_drain(struct worker *);
+static int  es_compress(struct es_state *, struct es_request *, const char *, size_t);
+static void es_single(struct worker *, struct payload *, const char *);
+static void es_bulk_reserve(struct es_request *, size_t);
+static void es_bulk_append(struct es_request *, const char *, size_t);
+static void es_bulk_puts(struct es_request *, const char *);
+static void es_bulk_escape(struct es_request *, const char *);
+static struct es_request *es_bulk_open(struct worker *, int64_t);
+static void es_bulk_flush(struct worker *, struct es_request *);
+static void es_bulk_add(struct es_state *, struct es_request *, struct payload *, const char *);
+static void es_bulk_hold(struct es_request *, struct payload *, size_t);
+static int  es_bulk_full(struct es_state *, struct es_request *);
+
+#define ES_BULK_DOCS    500
+#define ES_BULK_BYTES   (5 * 1024 * 1024)
+#define ES_BULK_AGE     1000
+#define ES_RESP_MAX     128
+#define ES_INFLIGHT     1
+#define ES_EWMA         5
+#define ES_EJECT_AFTER  3
+#define ES_BACKOFF_MIN  1000
+#define ES_BACKOFF_MAX  30000
+#define ES_RETRY_MIN    1000
+#define ES_RETRY_MAX    30000
+#define ES_CONNECT_TIMEOUT  10000
+#define ES_TIMEOUT      60000
+#define ES_GZIP_WINDOW  (15 + 16)
+#define ES_INDEX        "logstash-%Y%m%d"
+#define ES_INDEX_MAX    128
+#define ES_INDEX_CACHE  16
+#define ES_BULK_OPEN    4
+#define ES_DAY          86400
+#define ES_HOUR         3600
+
+/*
+ * Index names for recent days or hours, keyed by the number of days
+ * or hours since the epoch depending on the index pattern.
+ */
+struct es_index {
+    int64_t                  key;
+    char                     name[ES_INDEX_MAX];
+};
+
+/*
+ * Elasticsearch nodes, shared by all workers of an output.
+ *
+ * Requests go to the node with the fewest outstanding requests,
+ * weighted by its average latency. Nodes failing ES_EJECT_AFTER
+ * requests in a row are ejected, then probed with a single request
+ * once their backoff has elapsed. The backoff doubles each time a
+ * probe fails.
+ */
+struct es_node {
+    char                     url[URL_MAX];
+    uint32_t                 outstanding;
+    uint64_t                 latency;
+    uint32_t                 failures;
+    int                      probing;
+    uint64_t                 ejected;
+    uint64_t                 backoff;
+    struct metric_counter    requests;
+    struct metric_counter    errors;
+    struct metric_counter    ejections;
+};
+
+struct es_cluster {
+    uv_mutex_t               lock;
+    struct es_node          *nodes;
+    size_t                   nnodes;
+    size_t                   next;
+    size_t                   refs;
+    uint64_t                 raw_bytes;
+    uint64_t                 sent_bytes;
+    uint64_t                 compress_time;
+};
+
+/*
+ * Requests are driven by a curl multi handle, up to inflight of them
+ * at a time. Each request owns its easy handle, its body and the
+ * payloads it carries, which are released once it succeeds or is
+ * rejected for good. Requests failing on every node wait for retry_at
+ * to be tried again.
+ */
+struct es_request {
+    CURL                *curl;
+    struct es_node      *node;
+    char                *tried;
+    size_t               attempts;
+    char                 path[URL_MAX];
+    char                 url[2 * URL_MAX];
+    const char          *data;
+    size_t               data_len;
+    char                *zbody;
+    size_t               zbody_size;
+    char                 ebuf[CURL_ERROR_SIZE];
+    char                *body;
+    size_t               body_len;
+    size_t               body_size;
+    struct payload     **pending;
+    size_t               pending_size;
+    size_t               ndocs;
+    int64_t              key;
+    uint64_t             first;
+    uint64_t             sent;
+    uint64_t             backoff;
+    uint64_t             retry_at;
+    char                 resp[ES_RESP_MAX];
+    size_t               resp_len;
+};
 
 struct es_state {
-    CURL        *curl;
-    char         url[URL_MAX];
-    char         ebuf[CURL_ERROR_SIZE];
-    struct tm    stamp;
-    char         daybuf[9];
-    int          verbose;
+    CURLM               *multi;
+    struct es_cluster   *cluster;
+    char                 index[ES_INDEX_MAX];
+    char                 timestamp[KEY_MAX];
+    size_t               timestamp_len;
+    time_t               granularity;
+    struct es_index      indices[ES_INDEX_CACHE];
+    int64_t             *keys;
+    uint8_t             *grouped;
+    int                  verbose;
+    int                  bulk;
+    size_t               bulk_docs;
+    size_t               bulk_bytes;
+    uint64_t             bulk_age;
+    long                 connect_timeout;
+    long                 timeout;
+    struct curl_slist   *headers;
+    int                  compress;
+    int                  compress_level;
+    z_stream             zs;
+    struct es_request   *reqs;
+    struct es_request  **idle;
+    size_t               nidle;
+    struct es_request  **waiting;
+    size_t               nwaiting;
+    size_t               inflight;
+    size_t               running;
+    struct es_request   *open[ES_BULK_OPEN];
+    size_t               nopen;
 };
 
 void
@@ -41,19 +200,19 @@ es_curl_error(const char *ctx, const char *op, CURLcode code, const char *ebuf,
 {
     if (ebuf != NULL && strlen(ebuf)) {
         if (die) {
-            log_fatal("%s: curl error during %s (%ld): %s",
-                      ctx, op, code, ebuf);
+            log_fatal("%s: curl error during %s (%d): %s",
+                      ctx, op, (int)code, ebuf);
         } else {
-            log_error("%s: curl error during %s (%ld): %s",
-                      ctx, op, code, ebuf);
+            log_error("%s: curl error during %s (%d): %s",
+                      ctx, op, (int)code, ebuf);
         }
     } else {
         if (die) {
-            log_fatal("%s: curl error during %s (%ld)",
-                      ctx, op, code);
+            log_fatal("%s: curl error during %s (%d)",
+                      ctx, op, (int)code);
         } else {
-            log_error("%s: curl error during %s (%ld)",
-                      ctx, op, code);
+            log_error("%s: curl error during %s (%d)",
+                      ctx, op, (int)code);
         }
     }
 }
@@ -61,133 +220,1116 @@ es_curl_error(const char *ctx, const char *op, CURLcode code, const char *ebuf,
 size_t
 es_write(void *contents, size_t sz, size_t nmemb, void *p)
 {
+    struct es_request   *req = p;
+    size_t               len;
+
+    /*
+     * Only the beginning of the response is kept around, this is
+     * enough to figure out whether a bulk request had errors.
+     */
+    len = sz * nmemb;
+    if (req->resp_len + 1 < sizeof(req->resp)) {
+        if (len > sizeof(req->resp) - req->resp_len - 1)
+            len = sizeof(req->resp) - req->resp_len - 1;
+        memcpy(req->resp + req->resp_len, contents, len);
+        req->resp_len += len;
+        req->resp[req->resp_len] = '\0';
+    }
     return sz * nmemb;
 }
 
+void
+es_request_init(struct es_state *es, struct es_request *req)
+{
+    CURLcode             res;
+
+    if ((req->curl = curl_easy_init()) == NULL)
+        log_fatal("es_config: cannot create curl handle");
+    if ((req->tried = calloc(es->cluster->nnodes, 1)) == NULL)
+        log_sys_fatal("es_config: out of memory");
+
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_ERRORBUFFER, req->ebuf)) != CURLE_OK) {
+        es_curl_error("es_config", "errobuf", res, NULL, 1);
+    }
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_PRIVATE, (char *)req)) != CURLE_OK) {
+        es_curl_error("es_config", "private", res, req->ebuf, 1);
+    }
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_VERBOSE, es->verbose?1L:0L)) != CURLE_OK) {
+        es_curl_error("es_config", "verbose", res, req->ebuf, 1);
+    }
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_POST, 1L)) != CURLE_OK) {
+        es_curl_error("es_config", "post", res, req->ebuf, 1);
+    }
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, es_write)) != CURLE_OK) {
+        es_curl_error("es_config", "writefn", res, req->ebuf, 1);
+    }
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, req)) != CURLE_OK) {
+        es_curl_error("es_config", "writedata", res, req->ebuf, 1);
+    }
+    if (es->headers != NULL &&
+        (res = curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, es->headers)) != CURLE_OK) {
+        es_curl_error("es_config", "headers", res, req->ebuf, 1);
+    }
+    /*
+     * Timed out requests count as node failures, like any other
+     * transfer error, and are retried on another node.
+     */
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_CONNECTTIMEOUT_MS, es->connect_timeout)) != CURLE_OK) {
+        es_curl_error("es_config", "connecttimeout", res, req->ebuf, 1);
+    }
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_TIMEOUT_MS, es->timeout)) != CURLE_OK) {
+        es_curl_error("es_config", "timeout", res, req->ebuf, 1);
+    }
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_TCP_KEEPALIVE, 1L)) != CURLE_OK) {
+        es_curl_error("es_config", "keepalive", res, req->ebuf, 1);
+    }
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_TCP_KEEPIDLE, 300L)) != CURLE_OK) {
+        es_curl_error("es_config", "keepidle", res, req->ebuf, 1);
+    }
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_TCP_KEEPINTVL, 60L)) != CURLE_OK) {
+        es_curl_error("es_config", "keepinterval", res, req->ebuf, 1);
+    }
+    /*
+     * HTTP/2 is negotiated on TLS connections, concurrent requests
+     * are then multiplexed over a single connection. Waiting for
+     * that is better than opening a new connection per request.
+     */
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS)) != CURLE_OK) {
+        log_warn("es_config: HTTP/2 is not available, using HTTP/1.1");
+    }
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_PIPEWAIT, 1L)) != CURLE_OK) {
+        es_curl_error("es_config", "pipewait", res, req->ebuf, 1);
+    }
+}
+
 int
-es_start(struct output *out)
+es_start(struct worker *w)
 {
     struct es_state     *es;
     struct option       *opt;
-    time_t               now;
-    CURLcode             res;
+    char                *end;
+    size_t               i;
+    CURLMcode            mres;
 
     log_trace("es_start: enter");
     if ((es = calloc(1, sizeof(*es))) == NULL)
         log_sys_fatal("es_start: out of memory");
 
-    out->state = es;
+    w->state = es;
+    es->compress = -1;
+    es->compress_level = -1;
+
+    /*
+     * The node table is built by the first worker and shared with
+     * the other ones.
+     */
+    if ((es->cluster = w->out->state) == NULL) {
+        if ((es->cluster = calloc(1, sizeof(*es->cluster))) == NULL)
+            log_sys_fatal("es_start: out of memory");
+        uv_mutex_init(&es->cluster->lock);
+        w->out->state = es->cluster;
+        TAILQ_FOREACH(opt, &w->out->options, entry) {
+            if (strcasecmp(opt->key, "url") == 0)
+                es_node_add(es->cluster, opt->val);
+        }
+    }
+    es->cluster->refs++;
 
-    TAILQ_FOREACH(opt, &out->options, entry) {
+    TAILQ_FOREACH(opt, &w->out->options, entry) {
         if (strcasecmp(opt->key, "url") == 0) {
-            (void)strlcpy(es->url, opt->val, sizeof(es->url));
-            log_info("es_start: using url: %s", es->url);
+            continue;
         } else if (strcasecmp(opt->key, "verbose") == 0) {
             es->verbose = 1;
             log_info("es_start: setting verbose mode on");
+        } else if (strcasecmp(opt->key, "bulk") == 0) {
+            es->bulk = 1;
+        } else if (strcasecmp(opt->key, "bulk_docs") == 0) {
+            es->bulk = 1;
+            es->bulk_docs = strtoul(opt->val, NULL, 10);
+        } else if (strcasecmp(opt->key, "bulk_bytes") == 0) {
+            es->bulk = 1;
+            es->bulk_bytes = strtoul(opt->val, NULL, 10);
+        } else if (strcasecmp(opt->key, "bulk_age") == 0) {
+            es->bulk = 1;
+            es->bulk_age = strtoull(opt->val, NULL, 10);
+        } else if (strcasecmp(opt->key, "inflight") == 0) {
+            es->inflight = strtoul(opt->val, NULL, 10);
+        } else if (strcasecmp(opt->key, "connect_timeout") == 0) {
+            es->connect_timeout = strtol(opt->val, NULL, 10);
+        } else if (strcasecmp(opt->key, "timeout") == 0) {
+            es->timeout = strtol(opt->val, NULL, 10);
+        } else if (strcasecmp(opt->key, "compress") == 0) {
+            if (strcasecmp(opt->val, "gzip") == 0) {
+                es->compress = 1;
+            } else if (strcasecmp(opt->val, "none") == 0) {
+                es->compress = 0;
+            } else {
+                log_fatal("es_config: unknown compression: %s", opt->val);
+            }
+        } else if (strcasecmp(opt->key, "compress_level") == 0) {
+            es->compress_level = strtol(opt->val, &end, 10);
+            if (*opt->val == '\0' || *end != '\0' ||
+                es->compress_level < 0 || es->compress_level > 9)
+                log_fatal("es_config: invalid compression level: %s", opt->val);
+        } else if (strcasecmp(opt->key, "index") == 0) {
+            (void)strlcpy(es->index, opt->val, sizeof(es->index));
+        } else if (strcasecmp(opt->key, "timestamp") == 0) {
+            if (strlen(opt->val) > KEY_MAX - 1)
+                log_fatal("es_config: timestamp field name too long: %s", opt->val);
+            es->timestamp_len = strlcpy(es->timestamp, opt->val, sizeof(es->timestamp));
         } else {
             log_fatal("es_config: unknown option: %s", opt->key);
         }
     }
-    if (strlen(es->url) == 0) {
+    if (es->cluster->nnodes == 0) {
         log_fatal("es_config: need url to connect to");
     }
-    if (strlen(out->name) == 0) {
-        (void)strlcpy(out->name, "es", sizeof(out->name));
+    if (strlen(w->out->name) == 0) {
+        (void)strlcpy(w->out->name, "es", sizeof(w->out->name));
     }
+    if (es->inflight == 0)
+        es->inflight = ES_INFLIGHT;
 
-    if ((es->curl = curl_easy_init()) == NULL)
-        log_fatal("es_config: cannot create curl handle");
-
-    if ((res = curl_easy_setopt(es->curl, CURLOPT_ERRORBUFFER, es->ebuf)) != CURLE_OK) {
-        es_curl_error("es_config", "errobuf", res, NULL, 1);
+    /*
+     * Whatever the order they come in, compress=none and a level of
+     * 0 turn compression off, a level on its own turns it on.
+     */
+    if (es->compress == -1)
+        es->compress = (es->compress_level > 0);
+    if (es->compress_level == 0)
+        es->compress = 0;
+    if (es->compress_level == -1)
+        es->compress_level = Z_DEFAULT_COMPRESSION;
+    if (es->connect_timeout <= 0)
+        es->connect_timeout = ES_CONNECT_TIMEOUT;
+    if (es->timeout <= 0)
+        es->timeout = ES_TIMEOUT;
+    if (strlen(es->index) == 0)
+        (void)strlcpy(es->index, ES_INDEX, sizeof(es->index));
+    es->granularity = (strstr(es->index, "%H") != NULL ||
+                       strstr(es->index, "%k") != NULL) ? ES_HOUR : ES_DAY;
+    for (i = 0; i < ES_INDEX_CACHE; i++)
+        es->indices[i].key = INT64_MIN;
+    if ((es->keys = calloc(w->out->batch, sizeof(*es->keys))) == NULL)
+        log_sys_fatal("es_start: out of memory");
+    if ((es->grouped = calloc(w->out->batch, sizeof(*es->grouped))) == NULL)
+        log_sys_fatal("es_start: out of memory");
+    log_info("es_start: using index %s, routed by %s", es->index,
+             es->timestamp_len ? es->timestamp : "current time");
+    if (es->compress) {
+        if (deflateInit2(&es->zs, es->compress_level, Z_DEFLATED,
+                         ES_GZIP_WINDOW, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            log_fatal("es_config: cannot set up compression");
+        if ((es->headers = curl_slist_append(es->headers, "Content-Encoding: gzip")) == NULL)
+            log_fatal("es_config: cannot create compression headers");
+        log_info("es_start: gzip compression, level %d", es->compress_level);
     }
-    if ((res = curl_easy_setopt(es->curl, CURLOPT_VERBOSE, es->verbose?1L:0L)) != CURLE_OK) {
-        es_curl_error("es_config", "verbose", res, es->ebuf, 1);
+    if (es->bulk) {
+        if (es->bulk_docs == 0)
+            es->bulk_docs = ES_BULK_DOCS;
+        if (es->bulk_bytes == 0)
+            es->bulk_bytes = ES_BULK_BYTES;
+        if (es->bulk_age == 0)
+            es->bulk_age = ES_BULK_AGE;
+        log_info("es_start: bulk mode: %zu docs, %zu bytes, %llums",
+                 es->bulk_docs, es->bulk_bytes,
+                 (unsigned long long)es->bulk_age);
+        if ((es->headers = curl_slist_append(es->headers, "Content-Type: application/x-ndjson")) == NULL)
+            log_fatal("es_config: cannot create bulk headers");
     }
-    if ((res = curl_easy_setopt(es->curl, CURLOPT_POST, 1L)) != CURLE_OK) {
-        es_curl_error("es_config", "post", res, es->ebuf, 1);
+    /*
+     * Requests are metered when they complete, rather than when
+     * output_pop hands payloads over.
+     */
+    w->out->flags |= OUTPUT_BULK;
+
+    if ((es->multi = curl_multi_init()) == NULL)
+        log_fatal("es_config: cannot create curl multi handle");
+    if ((mres = curl_multi_setopt(es->multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX)) != CURLM_OK)
+        log_warn("es_config: cannot enable multiplexing: %s", curl_multi_strerror(mres));
+    if ((mres = curl_multi_setopt(es->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)es->inflight)) != CURLM_OK)
+        log_fatal("es_config: cannot limit connections: %s", curl_multi_strerror(mres));
+
+    if ((es->reqs = calloc(es->inflight, sizeof(*es->reqs))) == NULL)
+        log_sys_fatal("es_start: out of memory");
+    if ((es->idle = calloc(es->inflight, sizeof(*es->idle))) == NULL)
+        log_sys_fatal("es_start: out of memory");
+    if ((es->waiting = calloc(es->inflight, sizeof(*es->waiting))) == NULL)
+        log_sys_fatal("es_start: out of memory");
+    for (i = 0; i < es->inflight; i++) {
+        es_request_init(es, &es->reqs[i]);
+        if (es->bulk)
+            es_bulk_reserve(&es->reqs[i], es->bulk_bytes);
+        es->idle[es->nidle++] = &es->reqs[i];
     }
-    if ((res = curl_easy_setopt(es->curl, CURLOPT_WRITEFUNCTION, es_write)) != CURLE_OK) {
-        es_curl_error("es_config", "writefn", res, es->ebuf, 1);
+    log_info("es_start: up to %zu requests in flight", es->inflight);
+
+    w->state = es;
+    log_trace("es_start: success");
+    return 0;
+}
+
+int64_t
+es_index_key(struct es_state *es, time_t t)
+{
+    return (t >= 0) ? t / es->granularity : -((-t + es->granularity - 1) / es->granularity);
+}
+
+const char *
+es_index_name(struct es_state *es, int64_t key)
+{
+    struct es_index     *idx;
+    struct tm            tm;
+    time_t               t;
+
+    idx = &es->indices[(uint64_t)key % ES_INDEX_CACHE];
+    if (idx->key != key) {
+        t = key * es->granularity;
+        (void)gmtime_r(&t, &tm);
+        if (strftime(idx->name, sizeof(idx->name), es->index, &tm) == 0)
+            (void)strlcpy(idx->name, es->index, sizeof(idx->name));
+        idx->key = key;
     }
-    if ((res = curl_easy_setopt(es->curl, CURLOPT_TCP_KEEPALIVE, 1L)) != CURLE_OK) {
-        es_curl_error("es_config", "keepalive", res, es->ebuf, 1);
+    return idx->name;
+}
+
+/*
+ * Parse an ISO 8601 date, with optional time and UTC offset, or a
+ * number of seconds or milliseconds since the epoch.
+ */
+int
+es_timestamp(const char *s, size_t len, time_t *t)
+{
+    const char  *end = s + len;
+    struct tm    tm;
+    int          vals[6];
+    int          i;
+    int          n;
+    int          sign;
+    long         off;
+    long long    num;
+
+    if (s < end && *s >= '0' && *s <= '9') {
+        for (num = 0; s < end && *s >= '0' && *s <= '9'; s++)
+            num = num * 10 + (*s - '0');
+        *t = (num > 100000000000LL) ? num / 1000 : num;
+        return 0;
     }
-    if ((res = curl_easy_setopt(es->curl, CURLOPT_TCP_KEEPIDLE, 300L)) != CURLE_OK) {
-        es_curl_error("es_config", "keepidle", res, es->ebuf, 1);
+    if (s >= end || *s++ != '"')
+        return -1;
+
+    /*
+     * Fields of YYYY-MM-DDTHH:MM:SS, time may be left out.
+     */
+    bzero(vals, sizeof(vals));
+    for (i = 0; i < 6; i++) {
+        for (n = 0; s < end && *s >= '0' && *s <= '9'; s++, n++)
+            vals[i] = vals[i] * 10 + (*s - '0');
+        if (n == 0)
+            return -1;
+        if (i == 2 && (s >= end || (*s != 'T' && *s != ' ')))
+            break;
+        if (i < 5 && s < end)
+            s++;
     }
-    if ((res = curl_easy_setopt(es->curl, CURLOPT_TCP_KEEPINTVL, 60L)) != CURLE_OK) {
-        es_curl_error("es_config", "keepinterval", res, es->ebuf, 1);
+    while (s < end && (*s == '.' || (*s >= '0' && *s <= '9')))
+        s++;
+
+    off = 0;
+    if (s < end && (*s == '+' || *s == '-')) {
+        sign = (*s++ == '-') ? -1 : 1;
+        for (n = 0, num = 0; s < end && n < 4; s++) {
+            if (*s == ':')
+                continue;
+            if (*s < '0' || *s > '9')
+                break;
+            num = num * 10 + (*s - '0');
+            n++;
+        }
+        if (n != 4)
+            return -1;
+        off = sign * ((num / 100) * 3600 + (num % 100) * 60);
     }
-    now = time(NULL);
-    (void)gmtime_r(&now, &es->stamp);
-    strftime(es->daybuf, sizeof(es->daybuf), "%Y%m%d", &es->stamp);
-    out->state = es;
-    log_trace("es_start: success");
+
+    bzero(&tm, sizeof(tm));
+    tm.tm_year = vals[0] - 1900;
+    tm.tm_mon = vals[1] - 1;
+    tm.tm_mday = vals[2];
+    tm.tm_hour = vals[3];
+    tm.tm_min = vals[4];
+    tm.tm_sec = vals[5];
+    if (tm.tm_mon < 0 || tm.tm_mon > 11 || tm.tm_mday < 1 || tm.tm_mday > 31)
+        return -1;
+    *t = timegm(&tm) - off;
     return 0;
 }
 
+/*
+ * Only top-level timestamp fields are considered. Documents without
+ * a usable one go to the index for the current time, passed in as
+ * fallback.
+ */
+int64_t
+es_index_of(struct es_state *es, struct payload *payload, int64_t fallback)
+{
+    const char  *p;
+    time_t       t;
+
+    if (es->timestamp_len == 0)
+        return fallback;
+    p = scan_field(payload->buf, payload->len, es->timestamp, es->timestamp_len);
+    if (p != NULL && es_timestamp(p, payload->buf + payload->len - p, &t) == 0)
+        return es_index_key(es, t);
+    return fallback;
+}
+
+void
+es_node_add(struct es_cluster *cl, const char *url)
+{
+    struct es_node  *nodes;
+    struct es_node  *node;
+
+    nodes = realloc(cl->nodes, (cl->nnodes + 1) * sizeof(*nodes));
+    if (nodes == NULL)
+        log_sys_fatal("es_node_add: out of memory");
+    cl->nodes = nodes;
+    node = &cl->nodes[cl->nnodes];
+    bzero(node, sizeof(*node));
+    (void)strlcpy(node->url, url, sizeof(node->url));
+    log_info("es_node_add: node %zu: %s", cl->nnodes, node->url);
+    cl->nnodes++;
+}
+
+/*
+ * When every node is ejected, the one due back first is used anyway
+ * rather than failing requests outright. Retried requests skip the
+ * nodes they already failed on.
+ */
+struct es_node *
+es_node_pick(struct es_cluster *cl, const char *tried)
+{
+    struct es_node  *node;
+    struct es_node  *best = NULL;
+    struct es_node  *fallback = NULL;
+    uint64_t         now;
+    uint64_t         score;
+    uint64_t         min = 0;
+    size_t           i;
+
+    uv_mutex_lock(&cl->lock);
+    now = uv_hrtime();
+    for (i = 0; i < cl->nnodes; i++) {
+        node = &cl->nodes[(cl->next + i) % cl->nnodes];
+        if (node->ejected != 0 &&
+            (fallback == NULL || node->ejected < fallback->ejected))
+            fallback = node;
+        if (node->ejected > now || node->probing || tried[node - cl->nodes])
+            continue;
+        if (node->ejected != 0) {
+            best = node;
+            break;
+        }
+        score = (node->outstanding + 1) * MAX(node->latency, 1000);
+        if (best == NULL || score < min) {
+            best = node;
+            min = score;
+        }
+    }
+    if (best == NULL)
+        best = fallback;
+    if (best->ejected != 0 && best->ejected <= now) {
+        log_info("es_node_pick: probing node %s", best->url);
+        best->probing = 1;
+    }
+    best->outstanding++;
+    metric_inc(&best->requests);
+    cl->next++;
+    uv_mutex_unlock(&cl->lock);
+    return best;
+}
+
+void
+es_node_done(struct es_cluster *cl, struct es_node *node, int ok, uint64_t latency)
+{
+    uv_mutex_lock(&cl->lock);
+    node->outstanding--;
+    if (ok) {
+        if (node->latency == 0)
+            node->latency = latency;
+        else
+            node->latency = node->latency - node->latency / ES_EWMA + latency / ES_EWMA;
+        if (node->ejected != 0)
+            log_info("es_node_done: node %s is back", node->url);
+        node->failures = 0;
+        node->probing = 0;
+        node->ejected = 0;
+        node->backoff = 0;
+    } else {
+        metric_inc(&node->errors);
+        node->failures++;
+        if (node->probing ||
+            (node->ejected == 0 && node->failures >= ES_EJECT_AFTER)) {
+            node->backoff = (node->backoff == 0) ? ES_BACKOFF_MIN :
+                MIN(node->backoff * 2, ES_BACKOFF_MAX);
+            node->ejected = uv_hrtime() + node->backoff * 1000000ULL;
+            node->probing = 0;
+            metric_inc(&node->ejections);
+            log_warn("es_node_done: ejecting node %s for %llums", node->url,
+                     (unsigned long long)node->backoff);
+        }
+    }
+    uv_mutex_unlock(&cl->lock);
+}
+
+/*
+ * For requests which did not get an answer from the node about its
+ * own health: its failure count and latency are left alone. A probe
+ * is made again with the next request.
+ */
+void
+es_node_release(struct es_cluster *cl, struct es_node *node)
+{
+    uv_mutex_lock(&cl->lock);
+    node->outstanding--;
+    node->probing = 0;
+    uv_mutex_unlock(&cl->lock);
+}
+
+/*
+ * Get hold of an idle request, waiting for one to complete if they
+ * are all in flight.
+ */
+struct es_request *
+es_acquire(struct worker *w)
+{
+    struct es_state     *es = w->state;
+
+    while (es->nidle == 0)
+        es_progress(w, OUTPUT_TICK);
+    return es->idle[--es->nidle];
+}
+
 int
-es_payload(struct output *out, const char *type, const char *buf, size_t len)
+es_submit(struct worker *w, struct es_request *req, const char *buf, size_t len)
 {
-    struct es_state     *es = out->state;
+    struct es_state     *es = w->state;
     CURLcode             res;
-    char                 url[URL_MAX];
-    time_t               now;
-    struct tm            stamp;
+    CURLMcode            mres;
 
-    log_trace("es_payload: enter");
-    bzero(es->ebuf, sizeof(es->ebuf));
-    if ((res = curl_easy_setopt(es->curl, CURLOPT_VERBOSE, es->verbose?1L:0L)) != CURLE_OK) {
-        es_curl_error("es_config", "verbose", res, es->ebuf, 1);
+    bzero(req->ebuf, sizeof(req->ebuf));
+    req->resp_len = 0;
+    req->resp[0] = '\0';
+    req->data = buf;
+    req->data_len = len;
+    req->attempts++;
+    req->node = es_node_pick(es->cluster, req->tried);
+    snprintf(req->url, sizeof(req->url), "%s%s", req->node->url, req->path);
+    if (es->compress) {
+        if (es_compress(es, req, buf, len) != 0)
+            goto fail;
+        buf = req->zbody;
+        len = es->zs.total_out;
+    }
+    __atomic_add_fetch(&es->cluster->raw_bytes, req->data_len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&es->cluster->sent_bytes, len, __ATOMIC_RELAXED);
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, buf)) != CURLE_OK) {
+        es_curl_error("es_submit", "postfields", res, req->ebuf, 0);
+        goto fail;
     }
-    if ((res = curl_easy_setopt(es->curl, CURLOPT_POSTFIELDS, buf)) != CURLE_OK) {
-        es_curl_error("es_payload", "postfields", res, es->ebuf, 0);
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_POSTFIELDSIZE, (long)len)) != CURLE_OK) {
+        es_curl_error("es_submit", "postfieldsize", res, req->ebuf, 0);
+        goto fail;
+    }
+    if ((res = curl_easy_setopt(req->curl, CURLOPT_URL, req->url)) != CURLE_OK) {
+        es_curl_error("es_submit", "url", res, req->ebuf, 0);
+        goto fail;
+    }
+    req->sent = uv_hrtime();
+    if ((mres = curl_multi_add_handle(es->multi, req->curl)) != CURLM_OK) {
+        log_error("es_submit: cannot add request: %s", curl_multi_strerror(mres));
+        goto fail;
+    }
+    es->running++;
+    return 0;
+
+fail:
+    es_complete(w, req, CURLE_FAILED_INIT);
+    return -1;
+}
+
+/*
+ * The stream is reset rather than set up again for each request, and
+ * each request keeps its compressed body buffer around.
+ */
+int
+es_compress(struct es_state *es, struct es_request *req, const char *buf, size_t len)
+{
+    uint64_t     start;
+    size_t       bound;
+    char        *zbody;
+    int          res;
+
+    start = uv_hrtime();
+    if (deflateReset(&es->zs) != Z_OK) {
+        log_error("es_compress: cannot reset stream");
         return -1;
     }
-    if ((res = curl_easy_setopt(es->curl, CURLOPT_POSTFIELDSIZE, strlen(buf))) != CURLE_OK) {
-        es_curl_error("es_payload", "postfieldsize", res, es->ebuf, 0);
+    bound = deflateBound(&es->zs, len);
+    if (bound > req->zbody_size) {
+        if ((zbody = realloc(req->zbody, bound)) == NULL)
+            log_sys_fatal("es_compress: out of memory");
+        req->zbody = zbody;
+        req->zbody_size = bound;
+    }
+    es->zs.next_in = (Bytef *)buf;
+    es->zs.avail_in = len;
+    es->zs.next_out = (Bytef *)req->zbody;
+    es->zs.avail_out = req->zbody_size;
+    if ((res = deflate(&es->zs, Z_FINISH)) != Z_STREAM_END) {
+        log_error("es_compress: compression failed (%d)", res);
         return -1;
     }
-    now = time(NULL);
-    (void)gmtime_r(&now, &stamp);
+    __atomic_add_fetch(&es->cluster->compress_time, uv_hrtime() - start, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Account for a finished request. Its payloads are released, which
+ * lets their offsets be committed, only when it succeeded or when
+ * elasticsearch rejected it: such a request would fail again.
+ */
+void
+es_complete(struct worker *w, struct es_request *req, CURLcode code)
+{
+    struct es_state     *es = w->state;
+    long                 status = 0;
+    double               total = 0;
+    int                  failed = 0;
+    int                  healthy = 1;
+    int                  busy = 0;
 
-    if (stamp.tm_year > es->stamp.tm_year ||
-        stamp.tm_mon > es->stamp.tm_mon ||
-        stamp.tm_mday > es->stamp.tm_mday) {
-        strftime(es->daybuf, sizeof(es->daybuf), "%Y%m%d", &stamp);
+    if (code != CURLE_OK) {
+        es_curl_error("es_complete", "perform", code, req->ebuf, 0);
+        failed = 1;
+        healthy = 0;
+    } else {
+        (void)curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &status);
+        if (status == 429) {
+            log_warn("es_complete: node %s is busy", req->node->url);
+            failed = 1;
+            busy = 1;
+        } else if (status < 200 || status >= 300) {
+            log_error("es_complete: request to %s failed with status %ld",
+                      req->node->url, status);
+            failed = 1;
+            healthy = (status < 500);
+        } else if (es->bulk && strstr(req->resp, "\"errors\":true") != NULL) {
+            log_warn("es_complete: some documents were rejected");
+            metric_inc(&w->out->errors);
+        }
     }
-    memcpy(&es->stamp, &stamp, sizeof(es->stamp));
 
-    snprintf(url,
-             sizeof(url),
-             "%s/logstash-%s/%s",
-             es->url,
-             es->daybuf,
-             type);
+    /*
+     * Completions may be reaped a while after they happened, curl
+     * knows how long the request actually took.
+     */
+    if (req->sent != 0) {
+        (void)curl_easy_getinfo(req->curl, CURLINFO_TOTAL_TIME, &total);
+        metric_meter_value(&w->out->meter, (uint64_t)(total * 1000000.0));
+        if (busy)
+            es_node_release(es->cluster, req->node);
+        else
+            es_node_done(es->cluster, req->node, healthy, (uint64_t)(total * 1000000.0));
+    } else if (req->node != NULL) {
+        es_node_release(es->cluster, req->node);
+    }
+    if (!healthy)
+        req->tried[req->node - es->cluster->nodes] = 1;
+    req->node = NULL;
+    req->sent = 0;
 
-    if ((res = curl_easy_setopt(es->curl, CURLOPT_URL, url)) != CURLE_OK) {
-        es_curl_error("es_payload", "url", res, es->ebuf, 0);
-        return -1;
+    if (failed)
+        metric_add(&w->out->errors, (req->ndocs > 0) ? req->ndocs : 1);
+
+    /*
+     * Requests failing because of their node are tried once on each
+     * of the other nodes, then again on all of them after a backoff.
+     * Back-pressure is the cluster's rather than the node's, those
+     * requests only back off.
+     */
+    if (busy) {
+        es_defer(w, req);
+        return;
     }
-    res = curl_easy_perform(es->curl);
-    if (res != CURLE_OK) {
-        es_curl_error("es_payload", "perform", res, es->ebuf, 0);
-        return -1;
+    if (!healthy && req->attempts < es->cluster->nnodes) {
+        log_warn("es_complete: retrying request on another node");
+        (void)es_submit(w, req, req->data, req->data_len);
+        return;
+    }
+    if (!healthy) {
+        es_defer(w, req);
+        return;
+    }
+
+    /*
+     * Sink time goes from the moment the first document was taken
+     * off the queue to the moment its request is done.
+     */
+    if (req->first != 0)
+        metric_meter_add(&w->out->sink, (uv_hrtime() - req->first) / 1000,
+                         (req->ndocs > 0) ? req->ndocs : 1);
+    es_finish(w, req, 1);
+}
+
+/*
+ * Hand a request back to the idle pool, releasing its payloads or
+ * leaving them held.
+ */
+void
+es_finish(struct worker *w, struct es_request *req, int release)
+{
+    struct es_state     *es = w->state;
+    size_t               i;
+
+    if (release) {
+        for (i = 0; i < req->ndocs; i++)
+            payload_release(req->pending[i]);
+    }
+    req->ndocs = 0;
+    req->body_len = 0;
+    req->attempts = 0;
+    bzero(req->tried, es->cluster->nnodes);
+    req->first = 0;
+    req->backoff = 0;
+    req->retry_at = 0;
+    es->idle[es->nidle++] = req;
+}
+
+/*
+ * Requests which failed on every node wait for a backoff, doubling
+ * each time, before they are tried again. Their payloads are still
+ * held, so once all requests are waiting the worker stops taking
+ * payloads off its queue, which fills up and holds the inputs back
+ * or makes them spill.
+ *
+ * Once the output is stopping they are given up on instead, without
+ * releasing their payloads: offsets are not committed past them and
+ * they will be consumed again on the next start.
+ */
+void
+es_defer(struct worker *w, struct es_request *req)
+{
+    struct es_state     *es = w->state;
+
+    req->attempts = 0;
+    bzero(req->tried, es->cluster->nnodes);
+    if (!(__atomic_load_n(&w->out->flags, __ATOMIC_ACQUIRE) & OUTPUT_RUN)) {
+        log_warn("es_defer: stopping, leaving %zu documents uncommitted", req->ndocs);
+        es_finish(w, req, 0);
+        return;
+    }
+    req->backoff = (req->backoff == 0) ? ES_RETRY_MIN :
+        MIN(req->backoff * 2, ES_RETRY_MAX);
+    req->retry_at = uv_hrtime() + req->backoff * 1000000ULL;
+    es->waiting[es->nwaiting++] = req;
+    log_warn("es_defer: retrying %zu documents in %llums",
+             req->ndocs, (unsigned long long)req->backoff);
+}
+
+void
+es_retry(struct worker *w)
+{
+    struct es_state     *es = w->state;
+    struct es_request   *req;
+    uint64_t             now;
+    size_t               i = 0;
+    int                  run;
+
+    run = __atomic_load_n(&w->out->flags, __ATOMIC_ACQUIRE) & OUTPUT_RUN;
+    now = uv_hrtime();
+    while (i < es->nwaiting) {
+        req = es->waiting[i];
+        if (run && req->retry_at > now) {
+            i++;
+            continue;
+        }
+        es->waiting[i] = es->waiting[--es->nwaiting];
+        if (!run) {
+            es_defer(w, req);
+            continue;
+        }
+        log_info("es_retry: retrying %zu documents", req->ndocs);
+        (void)es_submit(w, req, req->data, req->data_len);
+    }
+}
+
+/*
+ * Let curl move requests forward, waiting up to timeout milliseconds
+ * for network activity, and reap the ones which are done.
+ */
+void
+es_progress(struct worker *w, int timeout)
+{
+    struct es_state     *es = w->state;
+    struct es_request   *req;
+    CURLMsg             *msg;
+    int                  running;
+    int                  left;
+    char                *priv;
+
+    if (es->nwaiting > 0)
+        es_retry(w);
+    (void)curl_multi_perform(es->multi, &running);
+    if (timeout > 0 && es->running > 0) {
+        (void)curl_multi_wait(es->multi, NULL, 0, timeout, NULL);
+        (void)curl_multi_perform(es->multi, &running);
+    } else if (timeout > 0 && es->nwaiting > 0) {
+        (void)poll(NULL, 0, timeout);
+    }
+    while ((msg = curl_multi_info_read(es->multi, &left)) != NULL) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        priv = NULL;
+        (void)curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+        req = (struct es_request *)priv;
+        (void)curl_multi_remove_handle(es->multi, msg->easy_handle);
+        es->running--;
+        es_complete(w, req, msg->data.result);
+    }
+}
+
+/*
+ * Called once the output is stopping: requests waiting for a retry
+ * are given up on, those in flight are waited for.
+ */
+void
+es_drain(struct worker *w)
+{
+    struct es_state     *es = w->state;
+
+    while (es->nopen > 0)
+        es_bulk_flush(w, es->open[0]);
+    while (es->running > 0 || es->nwaiting > 0)
+        es_progress(w, OUTPUT_TICK);
+}
+
+void
+es_bulk_reserve(struct es_request *req, size_t len)
+{
+    size_t   size;
+    char    *body;
+
+    if (req->body_len + len <= req->body_size)
+        return;
+    size = (req->body_size == 0) ? 4096 : req->body_size;
+    while (size < req->body_len + len)
+        size *= 2;
+    if ((body = realloc(req->body, size)) == NULL)
+        log_sys_fatal("es_bulk_reserve: out of memory");
+    req->body = body;
+    req->body_size = size;
+}
+
+void
+es_bulk_append(struct es_request *req, const char *buf, size_t len)
+{
+    es_bulk_reserve(req, len);
+    memcpy(req->body + req->body_len, buf, len);
+    req->body_len += len;
+}
+
+void
+es_bulk_puts(struct es_request *req, const char *s)
+{
+    es_bulk_append(req, s, strlen(s));
+}
+
+/*
+ * Types come from decoded JSON strings and need to be escaped
+ * again before they can be put in an action line.
+ */
+void
+es_bulk_escape(struct es_request *req, const char *s)
+{
+    char    hex[8];
+
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            es_bulk_append(req, "\\", 1);
+            es_bulk_append(req, s, 1);
+        } else if ((unsigned char)*s < 0x20) {
+            (void)snprintf(hex, sizeof(hex), "\\u%04x", (unsigned char)*s);
+            es_bulk_append(req, hex, 6);
+        } else {
+            es_bulk_append(req, s, 1);
+        }
     }
-    log_trace("es_payload: success");
+}
+
+/*
+ * Each index being written to has its own bulk, so that documents
+ * for an index are kept together across batches. When no bulk is
+ * open for an index and all slots are taken, or no request is left
+ * to open one with, the oldest bulk is sent.
+ */
+struct es_request *
+es_bulk_open(struct worker *w, int64_t key)
+{
+    struct es_state     *es = w->state;
+    struct es_request   *req;
+    size_t               i;
+
+    for (i = 0; i < es->nopen; i++) {
+        if (es->open[i]->key == key)
+            return es->open[i];
+    }
+    if (es->nopen == ES_BULK_OPEN || (es->nidle == 0 && es->nopen > 0))
+        es_bulk_flush(w, es->open[0]);
+    req = es_acquire(w);
+    req->key = key;
+    es->open[es->nopen++] = req;
+    return req;
+}
+
+void
+es_bulk_flush(struct worker *w, struct es_request *req)
+{
+    struct es_state     *es = w->state;
+    size_t               i;
+
+    for (i = 0; i < es->nopen && es->open[i] != req; i++)
+        ;
+    if (i == es->nopen)
+        return;
+    memmove(&es->open[i], &es->open[i + 1], (es->nopen - i - 1) * sizeof(*es->open));
+    es->nopen--;
+
+    log_trace("es_bulk_flush: flushing %zu documents", req->ndocs);
+    (void)strlcpy(req->path, "/_bulk", sizeof(req->path));
+    (void)es_submit(w, req, req->body, req->body_len);
+}
+
+/*
+ * Payloads are held until their request has completed, so that
+ * their offsets are not committed before that.
+ */
+void
+es_bulk_hold(struct es_request *req, struct payload *payload, size_t hint)
+{
+    struct payload     **pending;
+
+    if (req->ndocs == req->pending_size) {
+        req->pending_size = (req->pending_size == 0) ? hint : req->pending_size * 2;
+        pending = realloc(req->pending, req->pending_size * sizeof(*pending));
+        if (pending == NULL)
+            log_sys_fatal("es_bulk_hold: out of memory");
+        req->pending = pending;
+    }
+    payload_retain(payload);
+    req->pending[req->ndocs++] = payload;
+}
+
+void
+es_bulk_add(struct es_state *es, struct es_request *req, struct payload *payload,
+            const char *index)
+{
+    char                *p;
+    size_t               off;
+
+    if (req->ndocs == 0)
+        req->first = uv_hrtime();
+    es_bulk_hold(req, payload, es->bulk_docs);
+
+    es_bulk_puts(req, "{\"index\":{\"_index\":\"");
+    es_bulk_escape(req, index);
+    es_bulk_puts(req, "\",\"_type\":\"");
+    es_bulk_escape(req, payload->type);
+    es_bulk_puts(req, "\"}}\n");
+
+    /*
+     * Documents must fit on a single line, newlines outside of
+     * strings are plain whitespace and can be swapped for spaces.
+     */
+    off = req->body_len;
+    es_bulk_append(req, payload->buf, payload->len);
+    for (p = memchr(req->body + off, '\n', payload->len);
+         p != NULL;
+         p = memchr(p, '\n', req->body + req->body_len - p))
+        *p = ' ';
+    es_bulk_puts(req, "\n");
+}
+
+int
+es_bulk_full(struct es_state *es, struct es_request *req)
+{
+    return (req->ndocs >= es->bulk_docs || req->body_len >= es->bulk_bytes);
+}
+
+/*
+ * Single documents are sent straight from the payload buffer, which
+ * is held until the request completes.
+ */
+void
+es_single(struct worker *w, struct payload *payload, const char *index)
+{
+    struct es_request   *req;
+
+    req = es_acquire(w);
+    req->first = uv_hrtime();
+    snprintf(req->path,
+             sizeof(req->path),
+             "/%s/%s",
+             index,
+             payload->type);
+    es_bulk_hold(req, payload, 1);
+    (void)es_submit(w, req, payload->buf, payload->len);
+}
+
+/*
+ * Failures are dealt with when requests complete, nothing is
+ * reported back.
+ *
+ * Documents are grouped by index, in order of first appearance,
+ * keeping their order within each index, and go to the bulk open
+ * for their index.
+ */
+size_t
+es_batch(struct worker *w, struct payload **batch, size_t count)
+{
+    struct es_state     *es = w->state;
+    struct es_request   *req;
+    const char          *index;
+    int64_t              now;
+    size_t               i;
+    size_t               j;
+
+    now = es_index_key(es, time(NULL));
+    for (i = 0; i < count; i++) {
+        es->keys[i] = es_index_of(es, batch[i], now);
+        es->grouped[i] = 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (es->grouped[i])
+            continue;
+        index = es_index_name(es, es->keys[i]);
+        req = NULL;
+        for (j = i; j < count; j++) {
+            if (es->grouped[j] || es->keys[j] != es->keys[i])
+                continue;
+            es->grouped[j] = 1;
+            if (!es->bulk) {
+                es_single(w, batch[j], index);
+                continue;
+            }
+            if (req == NULL)
+                req = es_bulk_open(w, es->keys[i]);
+            es_bulk_add(es, req, batch[j], index);
+            if (es_bulk_full(es, req)) {
+                es_bulk_flush(w, req);
+                req = NULL;
+            }
+        }
+    }
+    if (es->bulk)
+        (void)es_flush(w);
+    else
+        es_progress(w, 0);
     return 0;
 }
 
 int
-es_stop(struct output *out)
+es_flush(struct worker *w)
 {
-    struct es_state *es = out->state;
+    struct es_state     *es = w->state;
+    uint64_t             now;
+    size_t               i;
+
+    es_progress(w, 0);
+    now = uv_hrtime();
+    for (i = es->nopen; i > 0; i--) {
+        if (now - es->open[i - 1]->first >= es->bulk_age * 1000000ULL)
+            es_bulk_flush(w, es->open[i - 1]);
+    }
+    return 0;
+}
+
+/*
+ * Nodes are reported by index, urls do not make for valid metric
+ * names. The mapping is logged at startup.
+ */
+void
+es_stats(struct output *out, struct metric_buf *mb)
+{
+    struct es_cluster   *cl = out->state;
+    struct es_node      *node;
+    const char          *labels[3];
+    char                 idx[32];
+    size_t               i;
+    uint64_t             now;
+
+    if (cl == NULL)
+        return;
+
+    /*
+     * Compression time is cumulative, in milliseconds.
+     */
+    metric_emit_counter(mb, "bytes.raw", NULL, __atomic_load_n(&cl->raw_bytes, __ATOMIC_RELAXED));
+    metric_emit_counter(mb, "bytes.sent", NULL, __atomic_load_n(&cl->sent_bytes, __ATOMIC_RELAXED));
+    metric_emit_counter(mb, "compress.time", NULL,
+                        __atomic_load_n(&cl->compress_time, __ATOMIC_RELAXED) / 1000000);
+
+    labels[0] = "node";
+    labels[1] = idx;
+    labels[2] = NULL;
+    uv_mutex_lock(&cl->lock);
+    now = uv_hrtime();
+    for (i = 0; i < cl->nnodes; i++) {
+        node = &cl->nodes[i];
+        snprintf(idx, sizeof(idx), "%zu", i);
+        metric_emit(mb, "up", labels, node->ejected == 0 || node->ejected <= now);
+        metric_emit_counter(mb, "requests", labels, metric_value(&node->requests));
+        metric_emit_counter(mb, "errs", labels, metric_value(&node->errors));
+        metric_emit_counter(mb, "ejections", labels, metric_value(&node->ejections));
+        metric_emit(mb, "outstanding", labels, node->outstanding);
+        metric_emit(mb, "latency", labels, node->latency / 1000);
+    }
+    uv_mutex_unlock(&cl->lock);
+}
+
+int
+es_stop(struct worker *w)
+{
+    struct es_state *es = w->state;
+    size_t           i;
 
     log_trace("es_stop: enter");
-    if (es->curl != NULL)
-        curl_easy_cleanup(es->curl);
+    es_drain(w);
+    for (i = 0; i < es->inflight; i++) {
+        curl_easy_cleanup(es->reqs[i].curl);
+        free(es->reqs[i].body);
+        free(es->reqs[i].zbody);
+        free(es->reqs[i].pending);
+        free(es->reqs[i].tried);
+    }
+    if (es->multi != NULL)
+        curl_multi_cleanup(es->multi);
+    if (es->compress)
+        (void)deflateEnd(&es->zs);
+    if (es->headers != NULL)
+        curl_slist_free_all(es->headers);
+    free(es->reqs);
+    free(es->idle);
+    free(es->waiting);
+    free(es->keys);
+    free(es->grouped);
+    if (--es->cluster->refs == 0) {
+        w->out->state = NULL;
+        uv_mutex_destroy(&es->cluster->lock);
+        free(es->cluster->nodes);
+        free(es->cluster);
+    }
+    free(es);
     log_trace("es_stop: success");
     return 0;
 
@@ -196,5 +1338,8 @@ es_stop(struct output *out)
 struct output_impl es_output = {
     es_start,
     es_stop,
-    es_payload
+    NULL,
+    es_flush,
+    es_batch,
+    es_stats
 };
@@ -14,64 +14,489 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "unklog.h"
 
-static int  exec_start(struct output *);
-static int  exec_stop(struct output *);
-static int  exec_payload(struct output *, const char *, const char *, size_t);
+/*
+ * Each worker feeds its own child process through a pipe, running
+ * the output command line through the shell as popen would. Batches
+ * are written with writev on the non-blocking end of the pipe, time
+ * spent waiting for the child to make room is accounted for.
+ *
+ * When the child goes away, it is reaped and started again after a
+ * backoff which doubles with each failure, unless it had been up for
+ * a while. Payloads are written again from the first one the child
+ * did not get entirely.
+ */
+
+#define EXEC_BACKOFF_MIN    100
+#define EXEC_BACKOFF_MAX    30000
+#define EXEC_STABLE         10000
+#define EXEC_IOV_MAX        1024
+#define EXEC_KILL_WAIT      5000
+#define EXEC_WAIT_STEP      10
+
+/*
+ * Shared by all workers of an output, for statistics.
+ */
+struct exec_stats {
+    struct metric_counter    full;
+    struct metric_counter    respawns;
+    size_t                   refs;
+};
+
+struct exec_state {
+    struct exec_stats       *stats;
+    pid_t                    pid;
+    int                      fd;
+    uint64_t                 started;
+    uint64_t                 backoff;
+    uint64_t                 respawn_at;
+    uint64_t                 linger;
+    uint64_t                 first;
+    struct payload         **pending;
+    size_t                   npending;
+    struct iovec            *iov;
+};
+
+static int  exec_start(struct worker *);
+static int  exec_stop(struct worker *);
+static int  exec_payload(struct worker *, const char *, const char *, size_t);
+static size_t exec_batch(struct worker *, struct payload **, size_t);
+static int  exec_flush(struct worker *);
+static void exec_stats(struct output *, struct metric_buf *);
+static int  exec_spawn(struct worker *);
+static void exec_reap(struct worker *, int);
+static pid_t exec_wait(struct exec_state *, int *);
+static pid_t exec_kill(struct exec_state *, int *);
+static int  exec_ready(struct worker *);
+static size_t exec_writev(struct worker *, struct iovec *, size_t);
+static size_t exec_write(struct worker *, struct payload **, size_t);
+static size_t exec_drain(struct worker *);
 
 int
-exec_start(struct output *out)
+exec_spawn(struct worker *w)
 {
-    FILE        *stream;
+    struct exec_state   *ex = w->state;
+    sigset_t             mask;
+    int                  fds[2];
+    pid_t                pid;
 
-    log_trace("exec_start: enter");
-    if ((stream = popen(out->cmdline, "we")) == NULL)
-        log_sys_fatal("exec_start: cannot open stream");
-    (void)snprintf(out->name, sizeof(out->name), "exec");
-    out->state = stream;
-    log_trace("exec_start: success");
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        log_sys_error("exec_spawn: cannot create pipe");
+        return -1;
+    }
+    if ((pid = fork()) == -1) {
+        log_sys_error("exec_spawn: cannot fork");
+        (void)close(fds[0]);
+        (void)close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        (void)sigemptyset(&mask);
+        (void)sigprocmask(SIG_SETMASK, &mask, NULL);
+        (void)signal(SIGPIPE, SIG_DFL);
+        (void)setpgid(0, 0);
+        if (dup2(fds[0], STDIN_FILENO) == -1)
+            _exit(127);
+        (void)execl("/bin/sh", "sh", "-c", w->out->cmdline, (char *)NULL);
+        _exit(127);
+    }
+    (void)close(fds[0]);
+    if (fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1)
+        log_sys_error("exec_spawn: cannot make pipe non-blocking");
+    ex->pid = pid;
+    ex->fd = fds[1];
+    ex->started = uv_hrtime();
+    log_info("exec_spawn: started process %d for worker %zu", pid, w->id);
     return 0;
 }
 
+/*
+ * Collect the child once it has exited, or make it exit when its end
+ * of the pipe is gone, and schedule its replacement.
+ */
+void
+exec_reap(struct worker *w, int force)
+{
+    struct exec_state   *ex = w->state;
+    uint64_t             now;
+    pid_t                res;
+    int                  status;
+
+    if (ex->pid == -1)
+        return;
+    if (force) {
+        res = exec_kill(ex, &status);
+    } else {
+        do {
+            res = waitpid(ex->pid, &status, WNOHANG);
+        } while (res == -1 && errno == EINTR);
+    }
+    if (res == 0)
+        return;
+    if (res == ex->pid && WIFEXITED(status))
+        log_warn("exec_reap: process %d exited with status %d", ex->pid, WEXITSTATUS(status));
+    else if (res == ex->pid && WIFSIGNALED(status))
+        log_warn("exec_reap: process %d killed by signal %d", ex->pid, WTERMSIG(status));
+    (void)close(ex->fd);
+    ex->fd = -1;
+    ex->pid = -1;
+
+    now = uv_hrtime();
+    if (now - ex->started >= EXEC_STABLE * 1000000ULL)
+        ex->backoff = EXEC_BACKOFF_MIN;
+    ex->respawn_at = now + ex->backoff * 1000000ULL;
+    log_info("exec_reap: restarting in %llums", (unsigned long long)ex->backoff);
+    ex->backoff = MIN(ex->backoff * 2, EXEC_BACKOFF_MAX);
+}
+
+/*
+ * Wait up to EXEC_KILL_WAIT milliseconds for the child to exit,
+ * returns 0 if it has not.
+ */
+pid_t
+exec_wait(struct exec_state *ex, int *status)
+{
+    struct timespec  ts = { 0, EXEC_WAIT_STEP * 1000000 };
+    uint64_t         deadline;
+    pid_t            res;
+
+    deadline = uv_hrtime() + EXEC_KILL_WAIT * 1000000ULL;
+    for (;;) {
+        res = waitpid(ex->pid, status, WNOHANG);
+        if (res != 0 && !(res == -1 && errno == EINTR))
+            return res;
+        if (uv_hrtime() >= deadline)
+            return 0;
+        (void)nanosleep(&ts, NULL);
+    }
+}
+
+/*
+ * Ask the child to exit, and kill it if it does not in time. Children
+ * lead their own process group, so that processes started by the
+ * shell go along with it.
+ */
+pid_t
+exec_kill(struct exec_state *ex, int *status)
+{
+    pid_t   res;
+
+    (void)kill(-ex->pid, SIGTERM);
+    if ((res = exec_wait(ex, status)) != 0)
+        return res;
+    log_warn("exec_kill: process %d ignored SIGTERM, killing it", ex->pid);
+    (void)kill(-ex->pid, SIGKILL);
+    do {
+        res = waitpid(ex->pid, status, 0);
+    } while (res == -1 && errno == EINTR);
+    return res;
+}
+
+/*
+ * Make sure a child is running, returns -1 while backing off.
+ */
 int
-exec_payload(struct output *out, const char *type, const char *buf, size_t len)
+exec_ready(struct worker *w)
 {
+    struct exec_state   *ex = w->state;
 
-    FILE    *stream = out->state;
+    if (ex->pid != -1)
+        return 0;
+    if (uv_hrtime() < ex->respawn_at)
+        return -1;
+    metric_inc(&ex->stats->respawns);
+    if (exec_spawn(w) != 0) {
+        ex->respawn_at = uv_hrtime() + ex->backoff * 1000000ULL;
+        ex->backoff = MIN(ex->backoff * 2, EXEC_BACKOFF_MAX);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write vectors two by two, a payload then its newline. Returns the
+ * number of payloads which could not be written, which only happens
+ * once the output is stopping.
+ */
+size_t
+exec_writev(struct worker *w, struct iovec *iov, size_t niov)
+{
+    struct exec_state   *ex = w->state;
+    struct iovec         saved;
+    struct pollfd        pfd;
+    size_t               idx = 0;
+    size_t               off = 0;
+    ssize_t              n;
+    uint64_t             start;
+
+    while (idx < niov) {
+        if (exec_ready(w) != 0) {
+            if (!(__atomic_load_n(&w->out->flags, __ATOMIC_ACQUIRE) & OUTPUT_RUN))
+                return (niov - idx) / 2;
+            (void)poll(NULL, 0, OUTPUT_TICK);
+            continue;
+        }
 
-    if (stream == NULL) {
-        if ((stream = popen(out->cmdline, "we")) == NULL)
-            log_sys_fatal("exec_start: cannot open stream");
+        saved = iov[idx];
+        iov[idx].iov_base = (char *)iov[idx].iov_base + off;
+        iov[idx].iov_len -= off;
+        n = writev(ex->fd, iov + idx, MIN(niov - idx, EXEC_IOV_MAX));
+        iov[idx] = saved;
+
+        if (n >= 0) {
+            n += off;
+            off = 0;
+            while (idx < niov && (size_t)n >= iov[idx].iov_len) {
+                n -= iov[idx].iov_len;
+                idx++;
+            }
+            off = n;
+        } else if (errno == EAGAIN) {
+            start = uv_hrtime();
+            pfd.fd = ex->fd;
+            pfd.events = POLLOUT;
+            (void)poll(&pfd, 1, OUTPUT_TICK);
+            metric_add(&ex->stats->full, (uv_hrtime() - start) / 1000);
+            exec_reap(w, 0);
+        } else if (errno != EINTR) {
+            log_sys_error("exec_writev: cannot write to process %d", ex->pid);
+            exec_reap(w, 1);
+        }
+
+        /*
+         * A new child starts with the payload its predecessor
+         * only got part of.
+         */
+        if (ex->pid == -1) {
+            idx &= ~(size_t)1;
+            off = 0;
+        }
     }
+    return 0;
+}
+
+size_t
+exec_write(struct worker *w, struct payload **batch, size_t count)
+{
+    struct exec_state   *ex = w->state;
+    size_t               i;
 
-    log_trace("exec_payload: enter");
-    if (fprintf(stream, "%s\n", buf) < 0) {
-        (void)pclose(stream);
-        out->state = NULL;
+    for (i = 0; i < count; i++) {
+        ex->iov[2 * i].iov_base = batch[i]->buf;
+        ex->iov[2 * i].iov_len = batch[i]->len;
+        ex->iov[2 * i + 1].iov_base = "\n";
+        ex->iov[2 * i + 1].iov_len = 1;
     }
-    log_trace("exec_payload: success");
+    return exec_writev(w, ex->iov, 2 * count);
+}
+
+/*
+ * Write out payloads held back by linger. Only those written are
+ * released, the others stay pending and are written again later.
+ * Returns the number of payloads left.
+ */
+size_t
+exec_drain(struct worker *w)
+{
+    struct exec_state   *ex = w->state;
+    size_t               errors;
+    size_t               done;
+    size_t               i;
+
+    if (ex->npending == 0)
+        return 0;
+    if ((errors = exec_write(w, ex->pending, ex->npending)) > 0) {
+        metric_add(&w->out->errors, errors);
+        log_warn("exec_drain: could not write %zu payloads", errors);
+    }
+    done = ex->npending - errors;
+    for (i = 0; i < done; i++)
+        payload_release(ex->pending[i]);
+    memmove(ex->pending, ex->pending + done, errors * sizeof(*ex->pending));
+    ex->npending = errors;
+    return errors;
+}
+
+int
+exec_start(struct worker *w)
+{
+    struct exec_state   *ex;
+    struct option       *opt;
+
+    log_trace("exec_start: enter");
+    if ((ex = calloc(1, sizeof(*ex))) == NULL)
+        log_sys_fatal("exec_start: out of memory");
+    w->state = ex;
+    ex->pid = -1;
+    ex->fd = -1;
+    ex->backoff = EXEC_BACKOFF_MIN;
+
+    /*
+     * Words of the command line end up as options as well, only
+     * ours are looked at. They are taken out of the command line,
+     * which the shell would otherwise try to run linger=N as.
+     */
+    TAILQ_FOREACH(opt, &w->out->options, entry) {
+        if (strcasecmp(opt->key, "linger") == 0) {
+            ex->linger = strtoull(opt->val, NULL, 10);
+            config_strip(w->out->cmdline, opt->key);
+        }
+    }
+
+    if ((ex->stats = w->out->state) == NULL) {
+        if ((ex->stats = calloc(1, sizeof(*ex->stats))) == NULL)
+            log_sys_fatal("exec_start: out of memory");
+        w->out->state = ex->stats;
+    }
+    ex->stats->refs++;
+
+    if ((ex->iov = calloc(2 * w->out->batch, sizeof(*ex->iov))) == NULL)
+        log_sys_fatal("exec_start: out of memory");
+    if ((ex->pending = calloc(w->out->batch, sizeof(*ex->pending))) == NULL)
+        log_sys_fatal("exec_start: out of memory");
+    (void)snprintf(w->out->name, sizeof(w->out->name), "exec");
+    if (exec_spawn(w) != 0)
+        log_fatal("exec_start: cannot start %s", w->out->cmdline);
+    log_trace("exec_start: success");
     return 0;
 }
 
+/*
+ * With linger set, payloads are held until a full batch has built up
+ * or the oldest one has waited linger milliseconds. Payloads which do
+ * not fit because the previous batch could not be written are handed
+ * back to be processed again.
+ */
+size_t
+exec_batch(struct worker *w, struct payload **batch, size_t count)
+{
+    struct exec_state   *ex = w->state;
+    size_t               i;
+
+    log_trace("exec_batch: enter");
+    if (ex->linger == 0)
+        return exec_write(w, batch, count);
+    for (i = 0; i < count; i++) {
+        if (ex->npending == w->out->batch)
+            return count - i;
+        if (ex->npending == 0)
+            ex->first = uv_hrtime();
+        payload_retain(batch[i]);
+        ex->pending[ex->npending++] = batch[i];
+        if (ex->npending == w->out->batch)
+            (void)exec_drain(w);
+    }
+    if (ex->npending > 0 && uv_hrtime() - ex->first >= ex->linger * 1000000ULL)
+        (void)exec_drain(w);
+    log_trace("exec_batch: success");
+    return 0;
+}
+
+int
+exec_payload(struct worker *w, const char *type, const char *buf, size_t len)
+{
+    struct iovec    iov[2];
+
+    iov[0].iov_base = (void *)buf;
+    iov[0].iov_len = len;
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+    return (exec_writev(w, iov, 2) == 0) ? 0 : -1;
+}
+
+/*
+ * Called when the worker is idle: notice children which exited,
+ * replace them, and honor the linger deadline.
+ */
+int
+exec_flush(struct worker *w)
+{
+    struct exec_state   *ex = w->state;
+
+    exec_reap(w, 0);
+    (void)exec_ready(w);
+    if (ex->npending > 0 && uv_hrtime() - ex->first >= ex->linger * 1000000ULL)
+        (void)exec_drain(w);
+    return 0;
+}
+
+/*
+ * Pipe full time is cumulative, in milliseconds.
+ */
+void
+exec_stats(struct output *out, struct metric_buf *mb)
+{
+    struct exec_stats   *st = out->state;
+
+    if (st == NULL)
+        return;
+    metric_emit_counter(mb, "pipe.full", NULL, metric_value(&st->full) / 1000);
+    metric_emit_counter(mb, "respawns", NULL, metric_value(&st->respawns));
+}
+
+/*
+ * The child gets EOF and is waited for, so that it can write out
+ * what it has buffered.
+ */
 int
-exec_stop(struct output *out)
+exec_stop(struct worker *w)
 {
-    FILE    *stream = out->state;
+    struct exec_state   *ex = w->state;
+    int                  status;
 
     log_trace("exec_stop: enter");
-    if (stream == NULL) {
-        log_trace("es_stop: success");
-        return 0;
+
+    /*
+     * Payloads which could not be written are not released, their
+     * offsets are not committed.
+     */
+    if (exec_drain(w) > 0)
+        log_warn("exec_stop: leaving %zu payloads unwritten", ex->npending);
+
+    /*
+     * Children are expected to exit once their input is closed,
+     * those which do not are killed.
+     */
+    if (ex->pid != -1) {
+        (void)close(ex->fd);
+        if (exec_wait(ex, &status) == 0) {
+            log_warn("exec_stop: process %d still running, stopping it", ex->pid);
+            (void)exec_kill(ex, &status);
+        }
+    }
+    free(ex->iov);
+    free(ex->pending);
+    if (--ex->stats->refs == 0) {
+        w->out->state = NULL;
+        free(ex->stats);
     }
+    free(ex);
+    w->state = NULL;
     log_trace("exec_stop: success");
-    (void)pclose(stream);
     return 0;
 }
 
 struct output_impl exec_output = {
     exec_start,
     exec_stop,
-    exec_payload
+    exec_payload,
+    exec_flush,
+    exec_batch,
+    exec_stats
 };
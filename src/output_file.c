@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2016 Pierre-Yves Ritschard <pyr@spootnik.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <bsd/string.h>
+#include "unklog.h"
+
+/*
+ * Newline-delimited files, written a batch at a time with writev.
+ *
+ * Each worker writes to its own file, named after the time it was
+ * opened. Files are rotated once they reach rotate_size bytes, or on
+ * rotate_interval boundaries, so that hourly files start on the hour.
+ *
+ * Payloads are released once written, which lets their offsets be
+ * committed. Only the batch fsync policy has them on disk by then,
+ * the others trade that for fewer syncs.
+ */
+
+#define FILE_FSYNC_NONE     0
+#define FILE_FSYNC_BATCH    1
+#define FILE_FSYNC_INTERVAL 2
+#define FILE_FSYNC_ROTATE   3
+#define FILE_FSYNC_EVERY    1000
+#define FILE_IOV_MAX        1024
+#define FILE_PREFIX         "unklog"
+
+struct file_state {
+    char             dir[PATH_MAX];
+    char             prefix[PATH_MAX];
+    char             path[PATH_MAX];
+    int              fd;
+    size_t           size;
+    size_t           rotate_size;
+    time_t           rotate_interval;
+    time_t           rotate_at;
+    int              fsync;
+    uint64_t         fsync_every;
+    uint64_t         synced_at;
+    int              dirty;
+    struct iovec    *iov;
+    size_t           iovcnt;
+};
+
+static int      file_start(struct worker *);
+static int      file_stop(struct worker *);
+static int      file_payload(struct worker *, const char *, const char *, size_t);
+static size_t   file_batch(struct worker *, struct payload **, size_t);
+static int      file_flush(struct worker *);
+static int      file_open(struct worker *);
+static void     file_close(struct file_state *);
+static void     file_rotate(struct worker *);
+static void     file_sync(struct file_state *);
+static void     file_synced(struct file_state *);
+static void     file_failed(struct file_state *, size_t);
+static int      file_writev(struct file_state *, struct iovec *, size_t);
+
+int
+file_start(struct worker *w)
+{
+    struct file_state   *fs;
+    struct option       *opt;
+
+    log_trace("file_start: enter");
+    if ((fs = calloc(1, sizeof(*fs))) == NULL)
+        log_sys_fatal("file_start: out of memory");
+    fs->fd = -1;
+    w->state = fs;
+
+    TAILQ_FOREACH(opt, &w->out->options, entry) {
+        if (strcasecmp(opt->key, "dir") == 0) {
+            (void)strlcpy(fs->dir, opt->val, sizeof(fs->dir));
+        } else if (strcasecmp(opt->key, "prefix") == 0) {
+            (void)strlcpy(fs->prefix, opt->val, sizeof(fs->prefix));
+        } else if (strcasecmp(opt->key, "rotate_size") == 0) {
+            fs->rotate_size = strtoull(opt->val, NULL, 10);
+        } else if (strcasecmp(opt->key, "rotate_interval") == 0) {
+            fs->rotate_interval = strtoll(opt->val, NULL, 10);
+        } else if (strcasecmp(opt->key, "fsync") == 0) {
+            if (strcasecmp(opt->val, "none") == 0) {
+                fs->fsync = FILE_FSYNC_NONE;
+            } else if (strcasecmp(opt->val, "batch") == 0) {
+                fs->fsync = FILE_FSYNC_BATCH;
+            } else if (strcasecmp(opt->val, "interval") == 0) {
+                fs->fsync = FILE_FSYNC_INTERVAL;
+            } else if (strcasecmp(opt->val, "rotate") == 0) {
+                fs->fsync = FILE_FSYNC_ROTATE;
+            } else {
+                log_fatal("file_start: invalid fsync policy: %s", opt->val);
+            }
+        } else if (strcasecmp(opt->key, "fsync_interval") == 0) {
+            fs->fsync = FILE_FSYNC_INTERVAL;
+            fs->fsync_every = strtoull(opt->val, NULL, 10);
+        } else {
+            log_fatal("file_start: unknown option: %s", opt->key);
+        }
+    }
+    if (strlen(fs->dir) == 0)
+        log_fatal("file_start: need dir to write to");
+    if (strlen(fs->prefix) == 0)
+        (void)strlcpy(fs->prefix, FILE_PREFIX, sizeof(fs->prefix));
+    if (fs->fsync_every == 0)
+        fs->fsync_every = FILE_FSYNC_EVERY;
+    if (strlen(w->out->name) == 0)
+        (void)strlcpy(w->out->name, "file", sizeof(w->out->name));
+    if (mkdir(fs->dir, 0755) == -1 && errno != EEXIST)
+        log_sys_fatal("file_start: cannot create %s", fs->dir);
+
+    /*
+     * Two vectors per payload, one for the newline.
+     */
+    if ((fs->iov = calloc(2 * w->out->batch, sizeof(*fs->iov))) == NULL)
+        log_sys_fatal("file_start: out of memory");
+    if (file_open(w) != 0)
+        log_fatal("file_start: cannot open %s", fs->path);
+    log_info("file_start: writing to %s", fs->path);
+    log_trace("file_start: success");
+    return 0;
+}
+
+/*
+ * Files are named after the time they are opened, in UTC, with the
+ * worker number when there are several, and a sequence number should
+ * a file by that name already exist.
+ */
+int
+file_open(struct worker *w)
+{
+    struct file_state   *fs = w->state;
+    struct tm            tm;
+    char                 stamp[32];
+    char                 worker[32];
+    time_t               now;
+    size_t               len;
+    int                  i;
+
+    now = time(NULL);
+    (void)gmtime_r(&now, &tm);
+    (void)strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+    worker[0] = '\0';
+    if (w->out->nworkers > 1)
+        (void)snprintf(worker, sizeof(worker), ".%zu", w->id);
+    for (i = 0; fs->fd == -1; i++) {
+        if (i == 0)
+            len = snprintf(fs->path, sizeof(fs->path), "%s/%s-%s%s.log",
+                           fs->dir, fs->prefix, stamp, worker);
+        else
+            len = snprintf(fs->path, sizeof(fs->path), "%s/%s-%s%s-%d.log",
+                           fs->dir, fs->prefix, stamp, worker, i);
+        if (len >= sizeof(fs->path)) {
+            log_error("file_open: path too long in %s", fs->dir);
+            return -1;
+        }
+        fs->fd = open(fs->path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+        if (fs->fd == -1 && errno != EEXIST) {
+            log_sys_error("file_open: cannot open %s", fs->path);
+            return -1;
+        }
+    }
+    fs->size = 0;
+    fs->dirty = 0;
+    fs->synced_at = uv_hrtime();
+    if (fs->rotate_interval > 0)
+        fs->rotate_at = (now / fs->rotate_interval + 1) * fs->rotate_interval;
+    return 0;
+}
+
+void
+file_sync(struct file_state *fs)
+{
+    if (fs->fd != -1 && fs->dirty && fdatasync(fs->fd) == -1)
+        log_sys_error("file_sync: cannot sync %s", fs->path);
+    fs->dirty = 0;
+    fs->synced_at = uv_hrtime();
+}
+
+/*
+ * Apply the fsync policy after data has been written, or while idle.
+ */
+void
+file_synced(struct file_state *fs)
+{
+    if (fs->fsync == FILE_FSYNC_BATCH ||
+        (fs->fsync == FILE_FSYNC_INTERVAL &&
+         uv_hrtime() - fs->synced_at >= fs->fsync_every * 1000000ULL))
+        file_sync(fs);
+}
+
+/*
+ * Give up on the current file after a write error. A partially
+ * written line is cut off, it is written again to the next file.
+ */
+void
+file_failed(struct file_state *fs, size_t size)
+{
+    if (fs->size > size && ftruncate(fs->fd, size) == -1)
+        log_sys_error("file_failed: cannot truncate %s", fs->path);
+    fs->size = size;
+    file_close(fs);
+}
+
+void
+file_close(struct file_state *fs)
+{
+    if (fs->fd == -1)
+        return;
+    if (fs->fsync != FILE_FSYNC_NONE)
+        file_sync(fs);
+    (void)close(fs->fd);
+    fs->fd = -1;
+}
+
+/*
+ * Empty files are kept rather than rotated, their interval is moved
+ * forward instead.
+ */
+void
+file_rotate(struct worker *w)
+{
+    struct file_state   *fs = w->state;
+    time_t               now;
+
+    now = time(NULL);
+    if (fs->fd != -1 && fs->size == 0) {
+        if (fs->rotate_interval > 0 && now >= fs->rotate_at)
+            fs->rotate_at = (now / fs->rotate_interval + 1) * fs->rotate_interval;
+        return;
+    }
+    if (fs->fd != -1 &&
+        (fs->rotate_size == 0 || fs->size < fs->rotate_size) &&
+        (fs->rotate_interval == 0 || now < fs->rotate_at))
+        return;
+    log_debug("file_rotate: closing %s after %zu bytes", fs->path, fs->size);
+    file_close(fs);
+    (void)file_open(w);
+}
+
+/*
+ * Write all vectors, resuming after short writes.
+ */
+int
+file_writev(struct file_state *fs, struct iovec *iov, size_t iovcnt)
+{
+    ssize_t     n;
+    size_t      cnt;
+
+    while (iovcnt > 0) {
+        cnt = MIN(iovcnt, FILE_IOV_MAX);
+        if ((n = writev(fs->fd, iov, cnt)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        fs->size += n;
+        fs->dirty = 1;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Batches are split where the file reaches rotate_size, the rest goes
+ * to the next file. After a write error, only the payloads which did
+ * not make it to the file in full are reported back, they are handed
+ * over again and go to a new file.
+ */
+size_t
+file_batch(struct worker *w, struct payload **batch, size_t count)
+{
+    struct file_state   *fs = w->state;
+    size_t               start;
+    size_t               size;
+    size_t               i;
+    size_t               j;
+
+    log_trace("file_batch: enter");
+    for (i = 0; i < count; i = j) {
+        if (fs->fd == -1 && file_open(w) != 0)
+            return count - i;
+        for (j = i, size = fs->size;
+             j < count && (j == i || fs->rotate_size == 0 || size < fs->rotate_size);
+             j++) {
+            fs->iov[2 * (j - i)].iov_base = batch[j]->buf;
+            fs->iov[2 * (j - i)].iov_len = batch[j]->len;
+            fs->iov[2 * (j - i) + 1].iov_base = "\n";
+            fs->iov[2 * (j - i) + 1].iov_len = 1;
+            size += batch[j]->len + 1;
+        }
+        start = fs->size;
+        if (file_writev(fs, fs->iov, 2 * (j - i)) != 0) {
+            log_sys_error("file_batch: cannot write to %s", fs->path);
+            for (size = start;
+                 i < j && size + batch[i]->len + 1 <= fs->size;
+                 i++)
+                size += batch[i]->len + 1;
+            file_failed(fs, size);
+            return count - i;
+        }
+        file_synced(fs);
+        file_rotate(w);
+    }
+    log_trace("file_batch: success");
+    return 0;
+}
+
+int
+file_payload(struct worker *w, const char *type, const char *buf, size_t len)
+{
+    struct file_state   *fs = w->state;
+    struct iovec         iov[2];
+    size_t               start;
+
+    if (fs->fd == -1 && file_open(w) != 0)
+        return -1;
+    iov[0].iov_base = (void *)buf;
+    iov[0].iov_len = len;
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+    start = fs->size;
+    if (file_writev(fs, iov, 2) != 0) {
+        log_sys_error("file_payload: cannot write to %s", fs->path);
+        file_failed(fs, start);
+        return -1;
+    }
+    file_synced(fs);
+    file_rotate(w);
+    return 0;
+}
+
+/*
+ * Called when the worker is idle, so that files are rotated and
+ * synced on time even when no payloads come in.
+ */
+int
+file_flush(struct worker *w)
+{
+    struct file_state   *fs = w->state;
+
+    file_synced(fs);
+    file_rotate(w);
+    return 0;
+}
+
+int
+file_stop(struct worker *w)
+{
+    struct file_state   *fs = w->state;
+
+    log_trace("file_stop: enter");
+    file_close(fs);
+    free(fs->iov);
+    free(fs);
+    w->state = NULL;
+    log_trace("file_stop: success");
+    return 0;
+}
+
+struct output_impl file_output = {
+    file_start,
+    file_stop,
+    file_payload,
+    file_flush,
+    file_batch,
+    NULL
+};
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2016 Pierre-Yves Ritschard <pyr@spootnik.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "unklog.h"
+
+/*
+ * Memory held by all live payloads, headers included.
+ */
+static size_t   payload_bytes;
+
+/*
+ * A payload is allocated once per message and shared by all outputs.
+ * The header comes from a slab and a NUL-terminated copy of the
+ * message from an arena chunk, or from malloc when it is too large.
+ * The last output to release it frees it.
+ */
+struct payload *
+payload_new(const char *buf, size_t len, size_t refs)
+{
+    struct payload  *p;
+
+    if ((p = slab_alloc(sizeof(*p))) == NULL)
+        return NULL;
+    p->flags = PAYLOAD_ARENA;
+    if ((p->buf = arena_alloc(len + 1)) == NULL) {
+        p->flags = 0;
+        if ((p->buf = malloc(len + 1)) == NULL) {
+            slab_free(p, sizeof(*p));
+            return NULL;
+        }
+    }
+    __atomic_add_fetch(&payload_bytes, sizeof(*p) + len + 1, __ATOMIC_RELAXED);
+    p->refcnt = refs;
+    p->partition = -1;
+    p->tracker = NULL;
+    p->seq = 0;
+    p->timestamp = -1;
+    p->received = 0;
+    p->enqueued = 0;
+    p->len = len;
+    p->type[0] = '\0';
+    memcpy(p->buf, buf, len);
+    p->buf[len] = '\0';
+    return p;
+}
+
+void
+payload_retain(struct payload *p)
+{
+    __atomic_add_fetch(&p->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Once every output is done with a payload, the input it came from
+ * is told that its offset can be committed.
+ */
+void
+payload_release(struct payload *p)
+{
+    if (__atomic_sub_fetch(&p->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    if (p->tracker != NULL)
+        tracker_ack(p->tracker, p->seq);
+    __atomic_sub_fetch(&payload_bytes, sizeof(*p) + p->len + 1, __ATOMIC_RELAXED);
+    if (p->flags & PAYLOAD_ARENA)
+        arena_free(p->buf);
+    else
+        free(p->buf);
+    slab_free(p, sizeof(*p));
+}
+
+size_t
+payload_memory(void)
+{
+    return __atomic_load_n(&payload_bytes, __ATOMIC_RELAXED);
+}
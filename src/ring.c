@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2016 Pierre-Yves Ritschard <pyr@spootnik.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "unklog.h"
+
+/*
+ * Bounded multi-producer single-consumer queue of pointers.
+ *
+ * Each slot carries a sequence number telling whether it is ready to
+ * be written for a given lap, or ready to be read. Producers claim a
+ * position with a CAS on the head, the consumer owns the tail. An
+ * eventfd is used to wake the consumer up, but only when it
+ * announced that it was about to sleep. A second one wakes producers
+ * waiting for room in a full ring, once it is half empty again so
+ * they are not woken up for every single slot.
+ */
+
+#define RING_SPIN   16
+
+void
+ring_init(struct ring *r, size_t size)
+{
+    size_t  i;
+    size_t  cap;
+
+    for (cap = RING_MIN; cap < size; cap <<= 1)
+        ;
+    if ((r->slots = calloc(cap, sizeof(*r->slots))) == NULL)
+        log_sys_fatal("ring_init: out of memory");
+    for (i = 0; i < cap; i++)
+        r->slots[i].seq = i;
+    r->mask = cap - 1;
+    r->head = 0;
+    r->tail = 0;
+    r->parked = 0;
+    r->waiting = 0;
+    if ((r->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+        log_sys_fatal("ring_init: cannot create eventfd");
+    if ((r->sfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+        log_sys_fatal("ring_init: cannot create eventfd");
+}
+
+int
+ring_push(struct ring *r, void *data)
+{
+    struct ring_slot    *slot;
+    uint64_t             pos;
+    int64_t              dif;
+
+    pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &r->slots[pos & r->mask];
+        dif = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->data = data;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    ring_notify(r);
+    return 0;
+}
+
+/*
+ * Wake the consumer up if it is parked. Pairs with the fence in
+ * ring_wait: either the consumer sees the new item, or we see that
+ * it is parked. Only the first producer to notice writes to the
+ * eventfd.
+ */
+void
+ring_notify(struct ring *r)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->parked, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&r->parked, 0, __ATOMIC_ACQ_REL))
+        ring_wake(r);
+}
+
+/*
+ * Push, waiting for the consumer to make room if needed. Gives up
+ * once *stop is set, returns -1 in that case.
+ *
+ * The consumer only checks for waiting producers after popping, a
+ * wakeup missed in between costs at most OUTPUT_TICK milliseconds.
+ */
+int
+ring_put(struct ring *r, void *data, const uint32_t *stop)
+{
+    struct pollfd   pfd;
+    uint64_t        val;
+
+    while (ring_push(r, data) != 0) {
+        if (__atomic_load_n(stop, __ATOMIC_ACQUIRE))
+            return -1;
+        __atomic_store_n(&r->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ring_size(r) <= r->mask)
+            continue;
+        pfd.fd = r->sfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, OUTPUT_TICK) > 0)
+            (void)read(r->sfd, &val, sizeof(val));
+    }
+    return 0;
+}
+
+void *
+ring_pop(struct ring *r)
+{
+    struct ring_slot    *slot;
+    uint64_t             pos;
+    uint64_t             val = 1;
+    void                *data;
+
+    pos = r->tail;
+    slot = &r->slots[pos & r->mask];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return NULL;
+    data = slot->data;
+    __atomic_store_n(&slot->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->tail, pos + 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&r->waiting, __ATOMIC_RELAXED) &&
+        ring_size(r) <= (r->mask >> 1) &&
+        __atomic_exchange_n(&r->waiting, 0, __ATOMIC_ACQ_REL))
+        (void)write(r->sfd, &val, sizeof(val));
+    return data;
+}
+
+/*
+ * Approximate number of queued items, safe to call from producers.
+ */
+size_t
+ring_size(struct ring *r)
+{
+    uint64_t    head;
+    uint64_t    tail;
+
+    tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    return (head > tail) ? head - tail : 0;
+}
+
+int
+ring_empty(struct ring *r)
+{
+    struct ring_slot    *slot;
+
+    slot = &r->slots[r->tail & r->mask];
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != r->tail + 1;
+}
+
+/*
+ * Park the consumer until an item is pushed, ring_wake is called or
+ * timeout milliseconds elapse. Returns 0 on timeout.
+ *
+ * Producers are given a few chances to push before that: parking
+ * costs the consumer a poll and the next producer a write, which
+ * would otherwise be paid for every item or so whenever the consumer
+ * keeps up.
+ */
+int
+ring_wait(struct ring *r, int timeout)
+{
+    struct pollfd   pfd;
+    uint64_t        val;
+    int             res;
+    int             i;
+
+    for (i = 0; i < RING_SPIN; i++) {
+        if (!ring_empty(r))
+            return 1;
+        (void)sched_yield();
+    }
+    __atomic_store_n(&r->parked, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!ring_empty(r)) {
+        __atomic_store_n(&r->parked, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    pfd.fd = r->efd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    do {
+        res = poll(&pfd, 1, timeout);
+    } while (res == -1 && errno == EINTR);
+    if (res > 0)
+        (void)read(r->efd, &val, sizeof(val));
+    __atomic_store_n(&r->parked, 0, __ATOMIC_RELAXED);
+    return res > 0;
+}
+
+void
+ring_wake(struct ring *r)
+{
+    uint64_t    val = 1;
+
+    (void)write(r->efd, &val, sizeof(val));
+}
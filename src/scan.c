@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2016 Pierre-Yves Ritschard <pyr@spootnik.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+#include "unklog.h"
+
+#define SCAN_DEPTH  1024
+#define SCAN_OBJECT 0
+#define SCAN_ARRAY  1
+
+/*
+ * JSON validation for the dispatch hot path.
+ *
+ * Log messages spend most of their bytes inside strings, so the
+ * validator is a plain state machine over the structure which hands
+ * string bodies to a vectorized scanner. The scanner looks for the
+ * next quote, backslash, control character or non-ASCII byte, 16
+ * bytes at a time with SSE2 or 64 bytes at a time (two 32 byte loads)
+ * with AVX2, depending on what the CPU supports. Non-ASCII sequences
+ * are then checked for UTF-8 validity one at a time.
+ */
+
+typedef size_t  (*scan_string_t)(const unsigned char *, size_t);
+
+static size_t               scan_string_scalar(const unsigned char *, size_t);
+#ifdef SCAN_X86
+static size_t               scan_string_sse2(const unsigned char *, size_t);
+static size_t               scan_string_avx2(const unsigned char *, size_t);
+#endif
+static const unsigned char *scan_utf8(const unsigned char *, const unsigned char *);
+static const unsigned char *scan_str(const unsigned char *, const unsigned char *);
+static const unsigned char *scan_number(const unsigned char *, const unsigned char *);
+static const unsigned char *scan_ws(const unsigned char *, const unsigned char *);
+static const unsigned char *scan_skip(const unsigned char *, const unsigned char *);
+
+static scan_string_t    scan_string = scan_string_scalar;
+
+size_t
+scan_string_scalar(const unsigned char *p, size_t len)
+{
+    size_t  i;
+
+    for (i = 0; i < len; i++) {
+        if (p[i] == '"' || p[i] == '\\' || p[i] < 0x20 || p[i] >= 0x80)
+            break;
+    }
+    return i;
+}
+
+#ifdef SCAN_X86
+/*
+ * A signed comparison against 0x20 flags both control characters
+ * and bytes with the high bit set, which start UTF-8 sequences.
+ */
+__attribute__((target("sse2")))
+size_t
+scan_string_sse2(const unsigned char *p, size_t len)
+{
+    size_t      i;
+    int         mask;
+    __m128i     v;
+    __m128i     quote = _mm_set1_epi8('"');
+    __m128i     bslash = _mm_set1_epi8('\\');
+    __m128i     space = _mm_set1_epi8(0x20);
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(p + i));
+        mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+            _mm_cmplt_epi8(v, space)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_string_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+size_t
+scan_string_avx2(const unsigned char *p, size_t len)
+{
+    size_t      i;
+    uint64_t    mask;
+    __m256i     lo;
+    __m256i     hi;
+    __m256i     quote = _mm256_set1_epi8('"');
+    __m256i     bslash = _mm256_set1_epi8('\\');
+    __m256i     space = _mm256_set1_epi8(0x20);
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        lo = _mm256_loadu_si256((const __m256i *)(p + i));
+        hi = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+        lo = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(lo, quote), _mm256_cmpeq_epi8(lo, bslash)),
+            _mm256_cmpgt_epi8(space, lo));
+        hi = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(hi, quote), _mm256_cmpeq_epi8(hi, bslash)),
+            _mm256_cmpgt_epi8(space, hi));
+        mask = (uint32_t)_mm256_movemask_epi8(lo) |
+            ((uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32);
+        if (mask != 0)
+            return i + __builtin_ctzll(mask);
+    }
+    return i + scan_string_sse2(p + i, len - i);
+}
+#endif
+
+void
+scan_init(void)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_string = scan_string_avx2;
+        log_debug("scan_init: using avx2 string scanner");
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_string = scan_string_sse2;
+        log_debug("scan_init: using sse2 string scanner");
+    }
+#endif
+}
+
+/*
+ * Check a single UTF-8 sequence, rejecting overlong forms,
+ * surrogates and code points past U+10FFFF.
+ */
+const unsigned char *
+scan_utf8(const unsigned char *p, const unsigned char *end)
+{
+    size_t          n;
+    unsigned char   lo = 0x80;
+    unsigned char   hi = 0xbf;
+
+    if (*p >= 0xc2 && *p <= 0xdf) {
+        n = 1;
+    } else if (*p >= 0xe0 && *p <= 0xef) {
+        n = 2;
+        if (*p == 0xe0)
+            lo = 0xa0;
+        else if (*p == 0xed)
+            hi = 0x9f;
+    } else if (*p >= 0xf0 && *p <= 0xf4) {
+        n = 3;
+        if (*p == 0xf0)
+            lo = 0x90;
+        else if (*p == 0xf4)
+            hi = 0x8f;
+    } else {
+        return NULL;
+    }
+    if ((size_t)(end - p) <= n)
+        return NULL;
+    p++;
+    if (*p < lo || *p > hi)
+        return NULL;
+    for (p++, n--; n > 0; p++, n--) {
+        if (*p < 0x80 || *p > 0xbf)
+            return NULL;
+    }
+    return p;
+}
+
+/*
+ * Validate a string body, p points right after the opening quote.
+ */
+const unsigned char *
+scan_str(const unsigned char *p, const unsigned char *end)
+{
+    int     i;
+
+    for (;;) {
+        p += scan_string(p, end - p);
+        if (p >= end)
+            return NULL;
+        switch (*p) {
+        case '"':
+            return p + 1;
+        case '\\':
+            if (++p >= end)
+                return NULL;
+            switch (*p) {
+            case '"': case '\\': case '/': case 'b':
+            case 'f': case 'n': case 'r': case 't':
+                p++;
+                break;
+            case 'u':
+                if (end - p <= 4)
+                    return NULL;
+                for (i = 1; i <= 4; i++) {
+                    if (!((p[i] >= '0' && p[i] <= '9') ||
+                          (p[i] >= 'a' && p[i] <= 'f') ||
+                          (p[i] >= 'A' && p[i] <= 'F')))
+                        return NULL;
+                }
+                p += 5;
+                break;
+            default:
+                return NULL;
+            }
+            break;
+        default:
+            if (*p < 0x80)
+                return NULL;
+            if ((p = scan_utf8(p, end)) == NULL)
+                return NULL;
+            break;
+        }
+    }
+}
+
+const unsigned char *
+scan_number(const unsigned char *p, const unsigned char *end)
+{
+    if (p < end && *p == '-')
+        p++;
+    if (p >= end)
+        return NULL;
+    if (*p == '0') {
+        p++;
+    } else if (*p >= '1' && *p <= '9') {
+        while (p < end && *p >= '0' && *p <= '9')
+            p++;
+    } else {
+        return NULL;
+    }
+    if (p < end && *p == '.') {
+        if (++p >= end || *p < '0' || *p > '9')
+            return NULL;
+        while (p < end && *p >= '0' && *p <= '9')
+            p++;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-'))
+            p++;
+        if (p >= end || *p < '0' || *p > '9')
+            return NULL;
+        while (p < end && *p >= '0' && *p <= '9')
+            p++;
+    }
+    return p;
+}
+
+const unsigned char *
+scan_ws(const unsigned char *p, const unsigned char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        p++;
+    return p;
+}
+
+int
+scan_validate(const char *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    const unsigned char *end = p + len;
+    uint8_t              stack[SCAN_DEPTH];
+    int                  depth = 0;
+
+value:
+    p = scan_ws(p, end);
+    if (p >= end)
+        return -1;
+    switch (*p) {
+    case '{':
+        if (depth == SCAN_DEPTH)
+            return -1;
+        stack[depth++] = SCAN_OBJECT;
+        p = scan_ws(p + 1, end);
+        if (p < end && *p == '}') {
+            p++;
+            depth--;
+            goto next;
+        }
+        goto key;
+    case '[':
+        if (depth == SCAN_DEPTH)
+            return -1;
+        stack[depth++] = SCAN_ARRAY;
+        p = scan_ws(p + 1, end);
+        if (p < end && *p == ']') {
+            p++;
+            depth--;
+            goto next;
+        }
+        goto value;
+    case '"':
+        p = scan_str(p + 1, end);
+        break;
+    case 't':
+        p = (end - p >= 4 && memcmp(p, "true", 4) == 0) ? p + 4 : NULL;
+        break;
+    case 'f':
+        p = (end - p >= 5 && memcmp(p, "false", 5) == 0) ? p + 5 : NULL;
+        break;
+    case 'n':
+        p = (end - p >= 4 && memcmp(p, "null", 4) == 0) ? p + 4 : NULL;
+        break;
+    default:
+        p = scan_number(p, end);
+        break;
+    }
+    if (p == NULL)
+        return -1;
+
+next:
+    p = scan_ws(p, end);
+    if (depth == 0)
+        return (p == end) ? 0 : -1;
+    if (p >= end)
+        return -1;
+    if (*p == ',') {
+        p++;
+        if (stack[depth - 1] == SCAN_ARRAY)
+            goto value;
+        goto key;
+    }
+    if ((*p == '}' && stack[depth - 1] == SCAN_OBJECT) ||
+        (*p == ']' && stack[depth - 1] == SCAN_ARRAY)) {
+        p++;
+        depth--;
+        goto next;
+    }
+    return -1;
+
+key:
+    p = scan_ws(p, end);
+    if (p >= end || *p != '"')
+        return -1;
+    if ((p = scan_str(p + 1, end)) == NULL)
+        return -1;
+    p = scan_ws(p, end);
+    if (p >= end || *p != ':')
+        return -1;
+    p++;
+    goto value;
+}
+
+/*
+ * Skip over a value in a validated document, stopping at the comma
+ * or closing brace which follows it.
+ */
+const unsigned char *
+scan_skip(const unsigned char *p, const unsigned char *end)
+{
+    int     depth = 0;
+
+    for (; p < end; p++) {
+        switch (*p) {
+        case '"':
+            if ((p = scan_str(p + 1, end)) == NULL)
+                return NULL;
+            p--;
+            break;
+        case '{':
+        case '[':
+            depth++;
+            break;
+        case '}':
+        case ']':
+            if (depth-- == 0)
+                return p;
+            break;
+        case ',':
+            if (depth == 0)
+                return p;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Look up a top-level key in a document which went through
+ * scan_validate, without looking into nested values. Keys are
+ * compared as they appear in the document, escapes included.
+ * Returns the start of the value, or NULL.
+ */
+const char *
+scan_field(const char *buf, size_t len, const char *key, size_t klen)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    const unsigned char *end = p + len;
+    const unsigned char *k;
+    int                  match;
+
+    p = scan_ws(p, end);
+    if (p >= end || *p != '{')
+        return NULL;
+    for (p++;;) {
+        p = scan_ws(p, end);
+        if (p >= end || *p != '"')
+            return NULL;
+        k = p + 1;
+        if ((p = scan_str(k, end)) == NULL)
+            return NULL;
+        match = ((size_t)(p - 1 - k) == klen && memcmp(k, key, klen) == 0);
+        p = scan_ws(p, end);
+        if (p >= end || *p != ':')
+            return NULL;
+        p = scan_ws(p + 1, end);
+        if (match)
+            return (const char *)p;
+        if ((p = scan_skip(p, end)) == NULL || *p != ',')
+            return NULL;
+        p++;
+    }
+}
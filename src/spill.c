@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2016 Pierre-Yves Ritschard <pyr@spootnik.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <bsd/string.h>
+#include "unklog.h"
+
+/*
+ * Disk spill queue for outputs.
+ *
+ * When an output goes over its queue limits, payloads are appended to
+ * memory-mapped segment files instead of stopping the inputs. Once
+ * spilling has started, every payload for the output goes to disk
+ * until the worker has replayed all of them, so ordering is kept.
+ *
+ * Segments are reserved on disk up front, spilling is refused when
+ * that fails rather than faulting on a full disk later on. Spilled
+ * payloads are released, which lets their offsets be committed, only
+ * once their records have been synced. This happens once
+ * SPILL_SYNC bytes are pending, before payloads are read back, and
+ * when the worker is idle.
+ *
+ * Replayed payloads are acknowledged against a tracker attached to
+ * their segment. Segments are deleted once they have been read
+ * entirely and every payload read from them has been acknowledged.
+ * Segments left over by a previous run are replayed first.
+ */
+
+#define SPILL_MAGIC     0x474c4b55
+#define SPILL_SEGMENT   (64 * 1024 * 1024)
+#define SPILL_SYNC      (1024 * 1024)
+#define SPILL_RETRY     1000
+
+struct spill_record {
+    uint32_t    magic;
+    uint32_t    len;
+    uint32_t    tlen;
+    int32_t     partition;
+    int64_t     timestamp;
+    uint64_t    received;
+};
+
+static struct spill_segment *spill_segment_open(struct spill *, uint64_t, size_t, int);
+static void spill_segment_close(struct spill_segment *, int);
+static void spill_recover(struct spill *);
+static void spill_sync_locked(struct spill *);
+static void spill_hold(struct spill *, struct payload *, size_t);
+static int  spill_id_cmp(const void *, const void *);
+
+struct spill_segment *
+spill_segment_open(struct spill *s, uint64_t id, size_t size, int create)
+{
+    struct spill_segment    *seg;
+    struct spill_record      rec;
+    struct stat              st;
+    int                      res;
+
+    if ((seg = calloc(1, sizeof(*seg))) == NULL)
+        log_sys_fatal("spill_segment_open: out of memory");
+    seg->id = id;
+    if ((size_t)snprintf(seg->path, sizeof(seg->path), "%s/%016llx.spill",
+                         s->dir, (unsigned long long)id) >= sizeof(seg->path)) {
+        log_error("spill_segment_open: path too long in %s", s->dir);
+        free(seg);
+        return NULL;
+    }
+
+    if ((seg->fd = open(seg->path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0600)) == -1) {
+        log_sys_error("spill_segment_open: cannot open %s", seg->path);
+        free(seg);
+        return NULL;
+    }
+    if (create) {
+        if ((res = posix_fallocate(seg->fd, 0, size)) != 0) {
+            errno = res;
+            log_sys_error("spill_segment_open: cannot reserve %zu bytes for %s",
+                          size, seg->path);
+            spill_segment_close(seg, 1);
+            return NULL;
+        }
+    } else {
+        if (fstat(seg->fd, &st) == -1 || st.st_size == 0) {
+            spill_segment_close(seg, 1);
+            return NULL;
+        }
+        size = st.st_size;
+    }
+    seg->size = size;
+    seg->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->base == MAP_FAILED) {
+        log_sys_error("spill_segment_open: cannot map %s", seg->path);
+        seg->base = NULL;
+        spill_segment_close(seg, create);
+        return NULL;
+    }
+    seg->tracker = tracker_new(s->dir, 0);
+
+    /*
+     * Recovered segments end at the first slot without a valid
+     * record, the rest of the file is zero-filled. Records are not
+     * aligned, headers are copied out.
+     */
+    if (!create) {
+        while (seg->len + sizeof(rec) <= seg->size) {
+            memcpy(&rec, seg->base + seg->len, sizeof(rec));
+            if (rec.magic != SPILL_MAGIC ||
+                seg->len + sizeof(rec) + rec.tlen + rec.len > seg->size)
+                break;
+            seg->len += sizeof(rec) + rec.tlen + rec.len;
+        }
+        seg->synced = seg->len;
+        seg->sealed = 1;
+    }
+    return seg;
+}
+
+void
+spill_segment_close(struct spill_segment *seg, int remove)
+{
+    if (seg->base != NULL)
+        (void)munmap(seg->base, seg->size);
+    if (seg->fd != -1)
+        (void)close(seg->fd);
+    if (remove && unlink(seg->path) == -1)
+        log_sys_warn("spill_segment_close: cannot remove %s", seg->path);
+    if (seg->tracker != NULL)
+        tracker_free(seg->tracker);
+    free(seg);
+}
+
+int
+spill_id_cmp(const void *a, const void *b)
+{
+    const uint64_t  *x = a;
+    const uint64_t  *y = b;
+
+    return (*x > *y) - (*x < *y);
+}
+
+void
+spill_recover(struct spill *s)
+{
+    DIR                     *dir;
+    struct dirent           *de;
+    struct spill_segment    *seg;
+    uint64_t                *ids = NULL;
+    uint64_t                *nids;
+    size_t                   count = 0;
+    size_t                   i;
+    char                    *end;
+    unsigned long long       id;
+
+    if ((dir = opendir(s->dir)) == NULL)
+        log_sys_fatal("spill_recover: cannot open %s", s->dir);
+    while ((de = readdir(dir)) != NULL) {
+        id = strtoull(de->d_name, &end, 16);
+        if (end == de->d_name || strcmp(end, ".spill") != 0)
+            continue;
+        if ((nids = realloc(ids, (count + 1) * sizeof(*ids))) == NULL)
+            log_sys_fatal("spill_recover: out of memory");
+        ids = nids;
+        ids[count++] = id;
+    }
+    (void)closedir(dir);
+    if (count > 0)
+        qsort(ids, count, sizeof(*ids), spill_id_cmp);
+
+    for (i = 0; i < count; i++) {
+        if (ids[i] >= s->next)
+            s->next = ids[i] + 1;
+        if ((seg = spill_segment_open(s, ids[i], 0, 0)) == NULL)
+            continue;
+        s->bytes += seg->len;
+        TAILQ_INSERT_TAIL(&s->segments, seg, entry);
+    }
+    free(ids);
+    if (!TAILQ_EMPTY(&s->segments)) {
+        s->active = 1;
+        log_info("spill_recover: replaying %zu bytes from %s", s->bytes, s->dir);
+    }
+}
+
+struct spill *
+spill_open(const char *dir, size_t segsize)
+{
+    struct spill    *s;
+
+    if ((s = calloc(1, sizeof(*s))) == NULL)
+        log_sys_fatal("spill_open: out of memory");
+    (void)strlcpy(s->dir, dir, sizeof(s->dir));
+    s->segsize = (segsize > 0) ? segsize : SPILL_SEGMENT;
+    TAILQ_INIT(&s->segments);
+    TAILQ_INIT(&s->done);
+    uv_mutex_init(&s->lock);
+    if (mkdir(s->dir, 0700) == -1 && errno != EEXIST)
+        log_sys_fatal("spill_open: cannot create %s", s->dir);
+    spill_recover(s);
+    return s;
+}
+
+/*
+ * Append a payload if spilling is active or force is set. Returns 0
+ * when the payload went to disk, its reference is then held until
+ * the record is synced. No new segment is tried for SPILL_RETRY
+ * milliseconds after one could not be created.
+ */
+int
+spill_push(struct spill *s, struct payload *p, int force)
+{
+    struct spill_segment    *seg;
+    struct spill_segment    *last;
+    struct spill_record      rec;
+    size_t                   tlen;
+    size_t                   len;
+
+    uv_mutex_lock(&s->lock);
+    if (!s->active && !force) {
+        uv_mutex_unlock(&s->lock);
+        return -1;
+    }
+
+    tlen = strlen(p->type);
+    len = sizeof(rec) + tlen + p->len;
+    seg = TAILQ_LAST(&s->segments, spill_segment_list);
+    if (seg == NULL || seg->sealed || seg->len + len > seg->size) {
+        if (uv_hrtime() < s->retry_at) {
+            uv_mutex_unlock(&s->lock);
+            return -1;
+        }
+        if ((seg = spill_segment_open(s, s->next++, MAX(s->segsize, len), 1)) == NULL) {
+            s->retry_at = uv_hrtime() + SPILL_RETRY * 1000000ULL;
+            uv_mutex_unlock(&s->lock);
+            return -1;
+        }
+        if ((last = TAILQ_LAST(&s->segments, spill_segment_list)) != NULL)
+            last->sealed = 1;
+        TAILQ_INSERT_TAIL(&s->segments, seg, entry);
+    }
+
+    rec.magic = SPILL_MAGIC;
+    rec.len = p->len;
+    rec.tlen = tlen;
+    rec.partition = p->partition;
+    rec.timestamp = p->timestamp;
+    rec.received = p->received;
+    memcpy(seg->base + seg->len, &rec, sizeof(rec));
+    memcpy(seg->base + seg->len + sizeof(rec), p->type, tlen);
+    memcpy(seg->base + seg->len + sizeof(rec) + tlen, p->buf, p->len);
+    seg->len += len;
+    s->bytes += len;
+    s->active = 1;
+    spill_hold(s, p, len);
+    if (s->unsynced_bytes >= SPILL_SYNC)
+        spill_sync_locked(s);
+    uv_mutex_unlock(&s->lock);
+    return 0;
+}
+
+void
+spill_hold(struct spill *s, struct payload *p, size_t len)
+{
+    struct payload     **unsynced;
+    size_t               size;
+
+    if (s->nunsynced == s->unsynced_size) {
+        size = (s->unsynced_size == 0) ? 1024 : s->unsynced_size * 2;
+        if ((unsynced = realloc(s->unsynced, size * sizeof(*unsynced))) == NULL)
+            log_sys_fatal("spill_hold: out of memory");
+        s->unsynced = unsynced;
+        s->unsynced_size = size;
+    }
+    s->unsynced[s->nunsynced++] = p;
+    s->unsynced_bytes += len;
+}
+
+/*
+ * Sync what was written since the last time, then release the
+ * payloads it holds. They stay held should syncing fail, and are
+ * tried again next time.
+ */
+void
+spill_sync_locked(struct spill *s)
+{
+    struct spill_segment    *seg;
+    size_t                   page;
+    size_t                   off;
+    size_t                   i;
+
+    if (s->nunsynced == 0)
+        return;
+    page = sysconf(_SC_PAGESIZE);
+    TAILQ_FOREACH(seg, &s->segments, entry) {
+        if (seg->synced == seg->len)
+            continue;
+        off = seg->synced & ~(page - 1);
+        if (msync(seg->base + off, seg->len - off, MS_SYNC) == -1) {
+            log_sys_error("spill_sync: cannot sync %s", seg->path);
+            return;
+        }
+        seg->synced = seg->len;
+    }
+    for (i = 0; i < s->nunsynced; i++)
+        payload_release(s->unsynced[i]);
+    s->nunsynced = 0;
+    s->unsynced_bytes = 0;
+}
+
+void
+spill_sync(struct spill *s)
+{
+    uv_mutex_lock(&s->lock);
+    spill_sync_locked(s);
+    uv_mutex_unlock(&s->lock);
+}
+
+/*
+ * Read up to max payloads back, in the order they were written.
+ * Returns the number of payloads read and the bytes they used.
+ */
+size_t
+spill_pop(struct spill *s, struct payload **batch, size_t max, size_t *bytes)
+{
+    struct spill_segment    *seg;
+    struct spill_record      rec;
+    struct payload          *p;
+    size_t                   count = 0;
+    size_t                   len;
+
+    *bytes = 0;
+    uv_mutex_lock(&s->lock);
+    spill_sync_locked(s);
+    while (count < max && (seg = TAILQ_FIRST(&s->segments)) != NULL) {
+        if (seg->off == seg->len) {
+            if (!seg->sealed && TAILQ_NEXT(seg, entry) == NULL)
+                break;
+            TAILQ_REMOVE(&s->segments, seg, entry);
+            TAILQ_INSERT_TAIL(&s->done, seg, entry);
+            continue;
+        }
+        memcpy(&rec, seg->base + seg->off, sizeof(rec));
+        len = sizeof(rec) + rec.tlen + rec.len;
+        if ((p = payload_new(seg->base + seg->off + sizeof(rec) + rec.tlen, rec.len, 1)) == NULL) {
+            log_sys_error("spill_pop: out of memory");
+            break;
+        }
+        (void)strlcpy(p->type, seg->base + seg->off + sizeof(rec),
+                      MIN(rec.tlen + 1, sizeof(p->type)));
+        p->partition = rec.partition;
+        p->timestamp = rec.timestamp;
+        p->received = rec.received;
+        p->tracker = seg->tracker;
+        p->seq = tracker_add(seg->tracker, seg->off);
+        seg->off += len;
+        s->bytes -= len;
+        *bytes += len;
+        batch[count++] = p;
+    }
+
+    /*
+     * Everything has been read back, new payloads can go through
+     * the queue again. The last segment will not be written to
+     * anymore.
+     */
+    if ((seg = TAILQ_FIRST(&s->segments)) == NULL ||
+        (TAILQ_NEXT(seg, entry) == NULL && seg->off == seg->len)) {
+        if (seg != NULL) {
+            seg->sealed = 1;
+            TAILQ_REMOVE(&s->segments, seg, entry);
+            TAILQ_INSERT_TAIL(&s->done, seg, entry);
+        }
+        s->active = 0;
+    }
+    uv_mutex_unlock(&s->lock);
+    return count;
+}
+
+/*
+ * Remove segments which have been read entirely and whose payloads
+ * have all been processed.
+ */
+void
+spill_collect(struct spill *s)
+{
+    struct spill_segment    *seg;
+    struct spill_segment    *next;
+
+    uv_mutex_lock(&s->lock);
+    for (seg = TAILQ_FIRST(&s->done); seg != NULL; seg = next) {
+        next = TAILQ_NEXT(seg, entry);
+        if (tracker_pending(seg->tracker) > 0)
+            continue;
+        TAILQ_REMOVE(&s->done, seg, entry);
+        log_debug("spill_collect: removing %s", seg->path);
+        spill_segment_close(seg, 1);
+    }
+    uv_mutex_unlock(&s->lock);
+}
+
+size_t
+spill_bytes(struct spill *s)
+{
+    size_t  bytes;
+
+    uv_mutex_lock(&s->lock);
+    bytes = s->bytes;
+    uv_mutex_unlock(&s->lock);
+    return bytes;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2016 Pierre-Yves Ritschard <pyr@spootnik.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "unklog.h"
+
+/*
+ * Offset tracking for at-least-once delivery.
+ *
+ * Each input partition has a tracker holding the offsets of messages
+ * which have been dispatched but not yet processed by every output,
+ * in the order they were consumed. Messages are identified by a
+ * sequence number handed out when they are added. Once the oldest
+ * messages are acknowledged the commit position moves past them, so
+ * it never goes beyond a message still sitting in an output queue.
+ */
+
+#define TRACKER_MIN 1024
+
+static void tracker_grow(struct tracker *);
+
+struct tracker *
+tracker_new(const char *topic, int32_t partition)
+{
+    struct tracker  *t;
+
+    if ((t = calloc(1, sizeof(*t))) == NULL)
+        log_sys_fatal("tracker_new: out of memory");
+    if ((t->topic = strdup(topic)) == NULL)
+        log_sys_fatal("tracker_new: out of memory");
+    t->partition = partition;
+    t->size = TRACKER_MIN;
+    if ((t->offsets = calloc(t->size, sizeof(*t->offsets))) == NULL)
+        log_sys_fatal("tracker_new: out of memory");
+    if ((t->done = calloc(t->size, sizeof(*t->done))) == NULL)
+        log_sys_fatal("tracker_new: out of memory");
+    t->position = -1;
+    t->committed = -1;
+    uv_mutex_init(&t->lock);
+    return t;
+}
+
+void
+tracker_grow(struct tracker *t)
+{
+    int64_t     *offsets;
+    uint8_t     *done;
+    size_t       size;
+    uint64_t     seq;
+
+    size = t->size * 2;
+    if ((offsets = calloc(size, sizeof(*offsets))) == NULL)
+        log_sys_fatal("tracker_grow: out of memory");
+    if ((done = calloc(size, sizeof(*done))) == NULL)
+        log_sys_fatal("tracker_grow: out of memory");
+    for (seq = t->head; seq < t->tail; seq++) {
+        offsets[seq % size] = t->offsets[seq % t->size];
+        done[seq % size] = t->done[seq % t->size];
+    }
+    free(t->offsets);
+    free(t->done);
+    t->offsets = offsets;
+    t->done = done;
+    t->size = size;
+}
+
+uint64_t
+tracker_add(struct tracker *t, int64_t offset)
+{
+    uint64_t    seq;
+
+    uv_mutex_lock(&t->lock);
+    if (t->tail - t->head == t->size)
+        tracker_grow(t);
+    seq = t->tail++;
+    t->offsets[seq % t->size] = offset;
+    t->done[seq % t->size] = 0;
+    uv_mutex_unlock(&t->lock);
+    return seq;
+}
+
+void
+tracker_ack(struct tracker *t, uint64_t seq)
+{
+    size_t      idx;
+
+    uv_mutex_lock(&t->lock);
+    /*
+     * Acknowledgements for messages dropped by tracker_reset are
+     * ignored.
+     */
+    if (seq >= t->head && seq < t->tail) {
+        t->done[seq % t->size] = 1;
+        while (t->head < t->tail) {
+            idx = t->head % t->size;
+            if (!t->done[idx])
+                break;
+            t->position = t->offsets[idx] + 1;
+            t->head++;
+        }
+    }
+    uv_mutex_unlock(&t->lock);
+}
+
+/*
+ * Forget about pending messages, used when a partition is revoked.
+ */
+void
+tracker_reset(struct tracker *t)
+{
+    uv_mutex_lock(&t->lock);
+    t->head = t->tail;
+    t->position = -1;
+    t->committed = -1;
+    uv_mutex_unlock(&t->lock);
+}
+
+int64_t
+tracker_position(struct tracker *t)
+{
+    int64_t     position;
+
+    uv_mutex_lock(&t->lock);
+    position = t->position;
+    uv_mutex_unlock(&t->lock);
+    return position;
+}
+
+size_t
+tracker_pending(struct tracker *t)
+{
+    size_t  pending;
+
+    uv_mutex_lock(&t->lock);
+    pending = t->tail - t->head;
+    uv_mutex_unlock(&t->lock);
+    return pending;
+}
+
+void
+tracker_free(struct tracker *t)
+{
+    uv_mutex_destroy(&t->lock);
+    free(t->offsets);
+    free(t->done);
+    free(t->topic);
+    free(t);
+}
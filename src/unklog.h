@@ -21,12 +21,34 @@
 #define OUTPUT_MAX  64
 #define INPUT_MAX   64
 #define KEY_MAX     64
+#define TYPE_MAX    64
 #define VAL_MAX     512
 #define URL_MAX     512
 #define METRIC_MAX  32
-#define SLOTS_MAX   13
+#define METRIC_INTERVAL 5000
+#define METRIC_TEXT 0
+#define METRIC_PROM 1
+#define METRIC_GAUGE    0
+#define METRIC_COUNTER  1
+#define OUTPUT_TICK 100
+#define OUTPUT_BACKOFF_MIN 100
+#define OUTPUT_BACKOFF_MAX 30000
+#define OUTPUT_BATCH 64
+#define RING_MIN    1024
+#define RING_SIZE   65536
+#define CACHELINE   64
 
 #define DEFAULT_CONFIG "/etc/unklog.conf"
+#define DEFAULT_SCAN   16384
+#define ARENA_CHUNK    (2 * 1024 * 1024)
+
+#define VALIDATE_FULL  0
+#define VALIDATE_LAZY  1
+
+#define MEMORY_BLOCK        0
+#define MEMORY_DROP_OLDEST  1
+#define MEMORY_DROP_TYPE    2
+#define MEMORY_TYPES        16
 
 #include <sys/queue.h>
 #include <sys/syslog.h>
@@ -43,38 +65,103 @@
 #endif
 
 struct output;
+struct worker;
+struct metric_buf;
 struct input;
+struct payload;
+struct message;
 
-typedef int     (*output_start_t)(struct output *);
-typedef int     (*output_stop_t)(struct output *);
-typedef int     (*output_payload_t)(struct output *, const char *, const char *, size_t);
+typedef int     (*output_start_t)(struct worker *);
+typedef int     (*output_stop_t)(struct worker *);
+typedef int     (*output_payload_t)(struct worker *, const char *, const char *, size_t);
+typedef int     (*output_flush_t)(struct worker *);
+typedef size_t  (*output_batch_t)(struct worker *, struct payload **, size_t);
+typedef void    (*output_stats_t)(struct output *, struct metric_buf *);
 
-typedef int     (*input_dispatch_t)(const char *, size_t, void *);
+typedef int     (*input_dispatch_t)(struct message *, size_t, void *);
 typedef int     (*input_start_t)(struct input *, input_dispatch_t, void *);
 typedef int     (*input_stop_t)(struct input *);
+typedef void    (*input_stats_t)(struct input *, struct metric_buf *);
+
+/*
+ * Meters are log-linear histograms of durations in microseconds:
+ * values below METRIC_SUB each get their own bucket, then each power
+ * of two is split in METRIC_SUB / 2 buckets, for a relative error of
+ * about 3%. Values are capped at 2^METRIC_BITS microseconds.
+ */
+#define METRIC_SUB_BITS 5
+#define METRIC_SUB      (1 << METRIC_SUB_BITS)
+#define METRIC_HALF     (METRIC_SUB / 2)
+#define METRIC_BITS     36
+#define METRIC_BUCKETS  ((METRIC_BITS - METRIC_SUB_BITS) * METRIC_HALF + METRIC_SUB)
 
-#define METRIC_2MS      0
-#define METRIC_5MS      1
-#define METRIC_10MS     2
-#define METRIC_20MS     3
-#define METRIC_50MS     4
-#define METRIC_100MS    5
-#define METRIC_200MS    6
-#define METRIC_500MS    7
-#define METRIC_1S       8
-#define METRIC_2S       9
-#define METRIC_5S       10
-#define METRIC_10S      11
-#define METRIC_SLOW     12
-#define METRIC_SLOTMAX  13
+/*
+ * Counters are split in shards, one per thread, each on its own
+ * cache line. Threads beyond the first METRIC_SHARDS - 1 share the
+ * last shard and update it atomically.
+ */
+#define METRIC_SHARDS   16
+
+struct metric_shard {
+    uint64_t            value;
+    char                pad[CACHELINE - sizeof(uint64_t)];
+};
 
 struct metric_counter {
-    uint64_t            metric;
+    struct metric_shard shards[METRIC_SHARDS];
 };
 
+/*
+ * Workers record into buckets, max and sum. Every interval these are
+ * moved to last, and added to total, by the loop thread.
+ */
 struct metric_meter {
     uint64_t            max;
-    uint32_t            slots[SLOTS_MAX];
+    uint64_t            sum;
+    uint64_t            buckets[METRIC_BUCKETS];
+    uint64_t            last_max;
+    uint64_t            last[METRIC_BUCKETS];
+    uint64_t            total_sum;
+    uint64_t            total[METRIC_BUCKETS];
+};
+
+/*
+ * Prometheus samples are rendered as they come, then sorted so that
+ * each family is contiguous. Families point at the name of their
+ * first sample.
+ */
+struct metric_sample {
+    size_t              family;
+    size_t              off;
+    size_t              len;
+};
+
+struct metric_family {
+    size_t              off;
+    size_t              len;
+    int                 type;
+};
+
+/*
+ * Growable buffer statistics are rendered into, along with the
+ * format and the input or output being rendered.
+ */
+struct metric_buf {
+    char               *buf;
+    size_t              len;
+    size_t              size;
+    char               *spare;
+    size_t              spare_size;
+    struct metric_sample *samples;
+    size_t              nsamples;
+    size_t              samples_size;
+    struct metric_family *families;
+    size_t              nfamilies;
+    size_t              families_size;
+    int                 format;
+    struct unklog      *uk;
+    const char         *scope;
+    const char         *name;
 };
 
 struct option {
@@ -84,23 +171,117 @@ struct option {
 };
 TAILQ_HEAD(option_list, option);
 
+struct tracker {
+    uv_mutex_t               lock;
+    char                    *topic;
+    int32_t                  partition;
+    int64_t                 *offsets;
+    uint8_t                 *done;
+    size_t                   size;
+    uint64_t                 head;
+    uint64_t                 tail;
+    int64_t                  position;
+    int64_t                  committed;
+};
+
+/*
+ * Timestamps follow messages through the pipeline: timestamp is the
+ * kafka timestamp in milliseconds, or -1, received the wall clock time
+ * at which the input got the message, in microseconds, and enqueued
+ * the uv_hrtime at which it was handed to the outputs.
+ */
+struct message {
+    const char              *buf;
+    size_t                   len;
+    int32_t                  partition;
+    struct tracker          *tracker;
+    uint64_t                 seq;
+    int64_t                  timestamp;
+    uint64_t                 received;
+};
+
 struct payload {
-    STAILQ_ENTRY(payload)    entry;
-    char                    *buf;
-    char                    *type;
+    uint32_t                 refcnt;
+    int32_t                  partition;
+#define PAYLOAD_ARENA        0x01
+    uint32_t                 flags;
+    struct tracker          *tracker;
+    uint64_t                 seq;
+    int64_t                  timestamp;
+    uint64_t                 received;
+    uint64_t                 enqueued;
     size_t                   len;
+    char                    *buf;
+    char                     type[TYPE_MAX];
+};
+
+struct ring_slot {
+    uint64_t                 seq;
+    void                    *data;
+};
+
+struct ring {
+    struct ring_slot        *slots;
+    size_t                   mask;
+    int                      efd;
+    int                      sfd;
+    uint64_t                 head __attribute__((aligned(CACHELINE)));
+    uint64_t                 tail __attribute__((aligned(CACHELINE)));
+    uint32_t                 parked;
+    uint32_t                 waiting;
 };
-STAILQ_HEAD(payload_list, payload);
 
+/*
+ * payload and payload_batch report failures, as -1 or as the number
+ * of payloads at the end of the batch which could not be processed.
+ * These are handed over again after a backoff: payloads are only
+ * released once processed, which is what lets offsets be committed.
+ * payload is only used by outputs without payload_batch.
+ */
 struct output_impl {
     output_start_t      start;
     output_stop_t       stop;
     output_payload_t    payload;
+    output_flush_t      flush;
+    output_batch_t      payload_batch;
+    output_stats_t      stats;
+};
+
+struct spill_segment {
+    TAILQ_ENTRY(spill_segment)   entry;
+    uint64_t                     id;
+    char                         path[PATH_MAX];
+    int                          fd;
+    char                        *base;
+    size_t                       size;
+    size_t                       len;
+    size_t                       off;
+    size_t                       synced;
+    int                          sealed;
+    struct tracker              *tracker;
+};
+TAILQ_HEAD(spill_segment_list, spill_segment);
+
+struct spill {
+    uv_mutex_t                   lock;
+    char                         dir[PATH_MAX];
+    size_t                       segsize;
+    uint64_t                     next;
+    int                          active;
+    size_t                       bytes;
+    uint64_t                     retry_at;
+    struct payload             **unsynced;
+    size_t                       nunsynced;
+    size_t                       unsynced_size;
+    size_t                       unsynced_bytes;
+    struct spill_segment_list    segments;
+    struct spill_segment_list    done;
 };
 
 struct input_impl {
     input_start_t   start;
     input_stop_t    stop;
+    input_stats_t   stats;
 };
 
 struct input {
@@ -120,22 +301,50 @@ struct input {
 };
 TAILQ_HEAD(input_list, input);
 
+struct worker {
+    struct output           *out;
+    size_t                   id;
+    uv_thread_t              thread;
+    void                    *state;
+    struct ring              ring;
+};
+
 struct output {
     TAILQ_ENTRY(output)      entry;
 #define OUTPUT_RUN           0x01
+#define OUTPUT_BULK          0x02
+#define OUTPUT_ORDERED       0x04
     uint8_t                  flags;
-    uv_thread_t              thread;
+    struct unklog           *uk;
     char                     name[OUTPUT_MAX];
     char                    *cmdline;
     void                    *state;
     struct output_impl      *impl;
     struct option_list       options;
-    struct payload_list      payloads;
-    uv_mutex_t               lock;
-    uv_cond_t                signal;
+    struct worker           *workers;
+    size_t                   nworkers;
+    size_t                   items;
+    size_t                   bytes;
+    size_t                   max_items;
+    size_t                   max_bytes;
+    size_t                   batch;
+    uint32_t                 full;
+    struct spill            *spill;
+    char                     spill_dir[PATH_MAX];
+    size_t                   spill_segment;
+    struct metric_counter    spilled;
+    struct metric_counter    replayed;
+    uint64_t                 spilled_last;
+    uint64_t                 replayed_last;
+    uint64_t                 spill_rate;
+    uint64_t                 replay_rate;
     struct metric_counter    count;
     struct metric_counter    errors;
+    struct metric_counter    dropped;
     struct metric_meter      meter;
+    struct metric_meter      delay;
+    struct metric_meter      queue;
+    struct metric_meter      sink;
 };
 TAILQ_HEAD(output_list, output);
 
@@ -151,15 +360,28 @@ struct unklog {
     uv_loop_t                loop;
     size_t                   incount;
     size_t                   outcount;
+    uint32_t                 congested;
+    uint32_t                 stopping;
     struct metric_counter    count;
+    int                      validate;
+    size_t                   scan;
+    size_t                   arena_chunk;
+    int                      hugepages;
+    size_t                   memory_limit;
+    int                      memory_policy;
+    char                     drop_types[MEMORY_TYPES][TYPE_MAX];
+    size_t                   ndrop_types;
+    uint32_t                 memory_full;
+    struct metric_counter    dropped;
     time_t                   uptime;
     uv_tcp_t                 proxy;
-    uv_buf_t                *mbufs;
-    size_t                   mcount;
     int                      mrun;
     char                     maddr[URL_MAX];
     int                      mport;
-    uv_mutex_t               mlock;
+    uv_tcp_t                 prom;
+    int                      prun;
+    char                     paddr[URL_MAX];
+    int                      pport;
 };
 
 /* input_kafka.c */
@@ -171,6 +393,9 @@ extern struct output_impl es_output;
 /* output_exec.c */
 extern struct output_impl exec_output;
 
+/* output_file.c */
+extern struct output_impl file_output;
+
 /* input.c */
 void    input_start(struct unklog *);
 void    input_stop(struct unklog *);
@@ -178,30 +403,119 @@ void    input_stop(struct unklog *);
 /* output.c */
 void    output_start(struct unklog *);
 void    output_stop(struct unklog *);
+void    output_push(struct output *, struct payload *);
+int     output_congested(struct unklog *);
+int     output_overcommitted(struct unklog *);
+
+/* ring.c */
+void     ring_init(struct ring *, size_t);
+int      ring_push(struct ring *, void *);
+int      ring_put(struct ring *, void *, const uint32_t *);
+void    *ring_pop(struct ring *);
+int      ring_empty(struct ring *);
+size_t   ring_size(struct ring *);
+int      ring_wait(struct ring *, int);
+void     ring_notify(struct ring *);
+void     ring_wake(struct ring *);
+
+/* tracker.c */
+struct tracker  *tracker_new(const char *, int32_t);
+uint64_t         tracker_add(struct tracker *, int64_t);
+void             tracker_ack(struct tracker *, uint64_t);
+void             tracker_reset(struct tracker *);
+int64_t          tracker_position(struct tracker *);
+size_t           tracker_pending(struct tracker *);
+void             tracker_free(struct tracker *);
+
+/* spill.c */
+struct spill    *spill_open(const char *, size_t);
+int              spill_push(struct spill *, struct payload *, int);
+size_t           spill_pop(struct spill *, struct payload **, size_t, size_t *);
+void             spill_collect(struct spill *);
+void             spill_sync(struct spill *);
+size_t           spill_bytes(struct spill *);
+
+/* arena.c */
+void             arena_init(size_t, int);
+void            *arena_alloc(size_t);
+void             arena_free(void *);
+void            *slab_alloc(size_t);
+void             slab_free(void *, size_t);
+void             arena_stats(struct metric_buf *);
+
+/* payload.c */
+struct payload  *payload_new(const char *, size_t, size_t);
+void             payload_retain(struct payload *);
+void             payload_release(struct payload *);
+size_t           payload_memory(void);
+
+/* scan.c */
+void    scan_init(void);
+int     scan_validate(const char *, size_t);
+const char *scan_field(const char *, size_t, const char *, size_t);
 
 /* dispatch.c */
-int dispatch_payload(const char *, size_t, void *);
+int dispatch_payload(struct message *, size_t, void *);
 
 /* config.c */
 void    config_parse(struct unklog *, const char *);
+void    config_strip(char *, const char *);
 
 /* metric.c */
 void    metric_counter_init(struct metric_counter *);
 void    metric_meter_init(struct metric_meter *);
 void    metric_inc(struct metric_counter *);
-void    metric_meter(struct metric_meter *, clock_t);
+void    metric_add(struct metric_counter *, uint64_t);
+uint64_t metric_value(struct metric_counter *);
+void    metric_meter(struct metric_meter *, uint64_t);
+void    metric_meter_value(struct metric_meter *, uint64_t);
+void    metric_meter_add(struct metric_meter *, uint64_t, uint64_t);
+uint64_t metric_realtime(void);
+void    metric_printf(struct metric_buf *, const char *, ...)
+            __attribute__((format(printf, 2, 3)));
+void    metric_emit(struct metric_buf *, const char *, const char **, uint64_t);
+void    metric_emit_counter(struct metric_buf *, const char *, const char **, uint64_t);
 void    metric_flush(uv_timer_t *);
 void    metric_start(struct unklog *);
 
 /* log.c */
-void log_init(int, const char *);
-void log_trace(const char *, ...);
-void log_debug(const char *, ...);
-void log_info(const char *, ...);
-void log_warn(const char *, ...);
-void log_error(const char *, ...);
-void log_fatal(const char *, ...);
-void log_sys_warn(const char *, ...);
-void log_sys_error(const char *, ...);
-void log_sys_fatal(const char *, ...);
-void log_print(int, int, const char *, ...);
+extern int log_level;
+void     log_init(int, const char *);
+void     log_start(void);
+void     log_flush(void);
+void     log_print(int, int, const char *, ...)
+             __attribute__((format(printf, 3, 4)));
+void     log_exit(void) __attribute__((noreturn));
+uint64_t log_dropped(void);
+
+/*
+ * Arguments are only evaluated when the level is enabled. Trace
+ * records are compiled out altogether with -DLOG_NO_TRACE.
+ */
+#define log_at(level, sys, ...)                                     \
+    do {                                                            \
+        if ((level) <= log_level)                                   \
+            log_print((level), (sys), __VA_ARGS__);                 \
+    } while (0)
+
+#ifdef LOG_NO_TRACE
+#define log_trace(...)      do { } while (0)
+#else
+#define log_trace(...)      log_at(LOG_TRACE, 0, __VA_ARGS__)
+#endif
+#define log_debug(...)      log_at(LOG_DEBUG, 0, __VA_ARGS__)
+#define log_info(...)       log_at(LOG_INFO, 0, __VA_ARGS__)
+#define log_warn(...)       log_at(LOG_WARNING, 0, __VA_ARGS__)
+#define log_error(...)      log_at(LOG_ERR, 0, __VA_ARGS__)
+#define log_sys_warn(...)   log_at(LOG_WARNING, 1, __VA_ARGS__)
+#define log_sys_error(...)  log_at(LOG_ERR, 1, __VA_ARGS__)
+#define log_fatal(...)                                              \
+    do {                                                            \
+        log_print(LOG_FATAL, 0, __VA_ARGS__);                       \
+        log_exit();                                                 \
+    } while (0)
+#define log_sys_fatal(...)                                          \
+    do {                                                            \
+        log_print(LOG_FATAL, 1, __VA_ARGS__);                       \
+        log_exit();                                                 \
+    } while (0)